@@ -58,9 +58,12 @@
 #define ALIGNMENT 8
 
 /* 
- * Maximum heap size in bytes 
+ * Maximum heap size in bytes, unless the MEM_MAX_HEAP environment
+ * variable gives another
  */
+#ifndef MAX_HEAP
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
+#endif
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
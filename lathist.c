@@ -0,0 +1,96 @@
+/*
+ * lathist.c - Log-bucketed latency histograms
+ *
+ * Values below 2^LATHIST_SUB_BITS get a bucket each. Above that, every
+ * power of two is split into 2^LATHIST_SUB_BITS equal buckets, so a
+ * bucket's width is at most 1/16th of the values it holds and a fixed
+ * array covers the whole range of an unsigned long, in the style of
+ * HdrHistogram.
+ */
+#include <string.h>
+#include "lathist.h"
+
+#define SUB_COUNT (1UL << LATHIST_SUB_BITS)
+
+/*
+ * bucket - Return the index of the bucket that holds value v
+ */
+static int bucket(unsigned long v)
+{
+    int shift;
+
+    if (v < SUB_COUNT)
+	return v;
+    shift = (63 - __builtin_clzl(v)) - LATHIST_SUB_BITS;
+    return ((shift + 1) << LATHIST_SUB_BITS) + (int)((v >> shift) - SUB_COUNT);
+}
+
+/*
+ * bucket_high - Return the largest value that falls in bucket i
+ */
+static unsigned long bucket_high(int i)
+{
+    int shift;
+
+    if ((unsigned long)i < SUB_COUNT)
+	return i;
+    shift = (i >> LATHIST_SUB_BITS) - 1;
+    return (((i & (SUB_COUNT - 1)) + SUB_COUNT) << shift) + 
+	((1UL << shift) - 1);
+}
+
+/*
+ * lathist_reset - Empty histogram h
+ */
+void lathist_reset(lathist_t *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+/*
+ * lathist_record - Add one sample of v to h
+ */
+void lathist_record(lathist_t *h, unsigned long v)
+{
+    h->counts[bucket(v)]++;
+    h->total++;
+    if (v > h->max)
+	h->max = v;
+}
+
+/*
+ * lathist_merge - Add every sample in src to dst
+ */
+void lathist_merge(lathist_t *dst, const lathist_t *src)
+{
+    int i;
+
+    for (i = 0; i < LATHIST_BUCKETS; i++)
+	dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    if (src->max > dst->max)
+	dst->max = src->max;
+}
+
+/*
+ * lathist_percentile - Return the value below which pct percent of the
+ *     samples in h fall. The value is rounded up to the top of its
+ *     bucket, but never past the largest sample.
+ */
+unsigned long lathist_percentile(const lathist_t *h, double pct)
+{
+    unsigned long rank, seen = 0;
+    int i;
+
+    if (h->total == 0)
+	return 0;
+    rank = (unsigned long)(pct / 100.0 * h->total + 0.5);
+    if (rank < 1)
+	rank = 1;
+    for (i = 0; i < LATHIST_BUCKETS; i++) {
+	seen += h->counts[i];
+	if (seen >= rank)
+	    return (bucket_high(i) < h->max) ? bucket_high(i) : h->max;
+    }
+    return h->max;
+}
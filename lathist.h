@@ -0,0 +1,28 @@
+#ifndef __LATHIST_H_
+#define __LATHIST_H_
+
+/*
+ * Log-bucketed latency histograms 
+ */
+#define LATHIST_SUB_BITS 4  /* 16 buckets per power of two: < 6.25% error */
+#define LATHIST_BUCKETS  ((64 - LATHIST_SUB_BITS + 1) << LATHIST_SUB_BITS)
+
+typedef struct {
+    unsigned long counts[LATHIST_BUCKETS]; /* samples in each bucket */
+    unsigned long total;                   /* number of samples */
+    unsigned long max;                     /* largest sample */
+} lathist_t;
+
+/* Empty histogram h */
+void lathist_reset(lathist_t *h);
+
+/* Add one sample of v (e.g., nanoseconds) to h */
+void lathist_record(lathist_t *h, unsigned long v);
+
+/* Add every sample in src to dst */
+void lathist_merge(lathist_t *dst, const lathist_t *src);
+
+/* Return the value below which pct percent of the samples in h fall */
+unsigned long lathist_percentile(const lathist_t *h, double pct);
+
+#endif /* __LATHIST_H_ */
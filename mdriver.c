@@ -16,10 +16,20 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef MM_THREAD_SAFE
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "lathist.h"
+#include "tracefmt.h"
+#include "stream.h"
 #include "config.h"
 
 /**********************
@@ -40,18 +50,13 @@
 
 /* Records the extent of each block's payload */
 typedef struct range_t {
-    char *lo;              /* low payload address */
-    char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    char *lo;               /* low payload address */
+    char *hi;               /* high payload address */
+    struct range_t *left;   /* ranges with lower addresses */
+    struct range_t *right;  /* ranges with higher addresses */
+    int height;             /* height of the subtree rooted here */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc/realloc request */
-} traceop_t;
-
 /* Holds the information for one trace file*/
 typedef struct {
     unsigned sugg_heapsize;   /* suggested heap size (unused) */
@@ -61,6 +66,12 @@ typedef struct {
     traceop_t *ops;      /* array of requests */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+    void *map;           /* mapping of a binary trace that ops points into */
+    size_t map_len;      /* ... and its length (0 for a text trace) */
+    size_t live_bytes;   /* payload bytes allocated during eval_mm_valid... */
+    size_t peak_bytes;   /* ... and their high-water mark, */
+    unsigned peak_op;    /* ... first reached by this request */
+    struct mm_stats peak_heap; /* mm_stats at peak_op, taken with -V */
 } trace_t;
 
 /* 
@@ -86,6 +97,48 @@ typedef struct {
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+/* The latency of each request in one replay of a trace, by request type */
+typedef struct {
+    int valid;             /* was the trace replayed? */
+    lathist_t hist[3];     /* nanoseconds per ALLOC, FREE and REALLOC */
+} lat_stats_t;
+
+#ifdef MM_THREAD_SAFE
+/* 
+ * A ring of frees that one replay thread hands to the next (-x). Each
+ * queue has exactly one producer and one consumer, so it needs no lock.
+ */
+#define XFREE_SLOTS 64    /* queue capacity; must be a power of two */
+
+typedef struct {
+    char *slots[XFREE_SLOTS];
+    unsigned head;   /* next slot to free; advanced by the consumer */
+    unsigned tail;   /* next slot to fill; advanced by the producer */
+    int done;        /* set once the producer will hand off no more */
+} xfree_t;
+
+/* Holds the params and results of one thread of a concurrent replay */
+typedef struct {
+    trace_t *trace;
+    int tid;         /* replays ops with index % nthreads == tid under -p */
+    char **blocks;   /* this thread's private copy of trace->blocks */
+    xfree_t *in;     /* frees handed to this thread (-x) */
+    xfree_t *out;    /* frees this thread hands to the next one (-x) */
+    double ops;      /* mm_malloc/mm_free/mm_realloc calls it made */
+    double secs;     /* wall-clock secs from the start barrier to its end */
+    int corrupt;     /* blocks whose first byte changed under it */
+    int failed;      /* the request that mm_* failed, or -1 */
+} replay_t;
+
+/* Summarizes a concurrent replay of one trace by nthreads threads */
+typedef struct {
+    int valid;       /* did every thread finish with intact blocks? */
+    double ops;      /* calls made by all threads */
+    double secs;     /* wall-clock secs of the slowest thread */
+    double *kops;    /* throughput of each thread */
+} mt_stats_t;
+#endif
+
 /********************
  * Global variables
  *******************/
@@ -101,12 +154,20 @@ static char *default_tracefiles[] = {
     DEFAULT_TRACEFILES, NULL
 };
 
+#ifdef MM_THREAD_SAFE
+/* Concurrent replay settings (-j, -p, -x) */
+static int nthreads = 1;     /* number of replay threads */
+static int partition = 0;    /* split one trace's blocks among the threads */
+static int cross_free = 0;   /* the next thread frees what a thread allocates */
+static pthread_barrier_t replay_barrier; /* starts the threads together */
+#endif
+
 
 /********************* 
  * Function prototypes 
  *********************/
 
-/* these functions manipulate range lists */
+/* these functions manipulate range trees */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum);
 static void remove_range(range_t **ranges, char *lo);
@@ -114,6 +175,9 @@ static void clear_ranges(range_t **ranges);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
+static int map_trace(trace_t *trace, int fd, char *path);
+static void alloc_blocks(trace_t *trace);
+static void grow_blocks(trace_t *trace, unsigned index);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
@@ -123,11 +187,26 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
+static int valid_ops(trace_t *trace, int tracenum, range_t **ranges,
+		     traceop_t *ops, unsigned n, unsigned first);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
 static void eval_mm_speed(void *ptr);
+static void speed_ops(trace_t *trace, traceop_t *ops, unsigned n);
+static void eval_mm_stream(char *tracedir, char *filename, int tracenum,
+			   range_t **ranges, stats_t *stats);
+static void eval_mm_latency(trace_t *trace, lat_stats_t *stats);
+#ifdef MM_THREAD_SAFE
+static void eval_mm_threads(trace_t *trace, int tracenum, mt_stats_t *stats);
+static void *replay_thread(void *ptr);
+#endif
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printlatency(int n, lat_stats_t *stats);
+static void printheapstats(struct mm_stats *st);
+#ifdef MM_THREAD_SAFE
+static void printthreads(int n, mt_stats_t *stats);
+#endif
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
@@ -147,10 +226,16 @@ int main(int argc, char **argv)
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
     speed_t speed_params;      /* input parameters to the xx_speed routines */ 
+#ifdef MM_THREAD_SAFE
+    mt_stats_t *mt_stats = NULL; /* concurrent replay stats (-j) */
+#endif
+    lat_stats_t *lat_stats = NULL; /* per-request latencies (-L) */
 
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int latency = 0;     /* If set, time every request (set by -L) */
+    int stream = 0;      /* If set, stream the traces from disk (set by -s) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -159,7 +244,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:hvVgalLsj:px")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -185,6 +270,33 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'L': /* Report the latency distribution of each request type */
+            latency = 1;
+            break;
+        case 's': /* Stream the traces instead of reading them into memory */
+            stream = 1;
+            break;
+#ifdef MM_THREAD_SAFE
+        case 'j': /* Also replay each trace on this many threads at once */
+            nthreads = atoi(optarg);
+            if (nthreads < 1) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'p': /* Partition each trace among the threads */
+            partition = 1;
+            break;
+        case 'x': /* Free each block on the thread after its allocator */
+            cross_free = 1;
+            break;
+#else
+        case 'j':
+        case 'p':
+        case 'x':
+            app_error("-j, -p and -x need the thread-safe driver, mdriver-mt");
+            break;
+#endif
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -199,6 +311,12 @@ int main(int argc, char **argv)
             exit(1);
         }
     }
+#ifdef MM_THREAD_SAFE
+    if (stream && (nthreads > 1 || partition || cross_free))
+	app_error("-s cannot be combined with -j, -p or -x");
+#endif
+    if (stream && latency)
+	app_error("-s cannot be combined with -L");
 	
     /* 
      * Check and print team info 
@@ -284,12 +402,28 @@ int main(int argc, char **argv)
     mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
     if (mm_stats == NULL)
 	unix_error("mm_stats calloc in main failed");
+    if (latency) {
+	lat_stats = (lat_stats_t *)calloc(num_tracefiles, sizeof(lat_stats_t));
+	if (lat_stats == NULL)
+	    unix_error("lat_stats calloc in main failed");
+    }
+#ifdef MM_THREAD_SAFE
+    if (nthreads > 1 || partition || cross_free) {
+	mt_stats = (mt_stats_t *)calloc(num_tracefiles, sizeof(mt_stats_t));
+	if (mt_stats == NULL)
+	    unix_error("mt_stats calloc in main failed");
+    }
+#endif
     
     /* Initialize the simulated memory system in memlib.c */
     mem_init(); 
 
     /* Evaluate student's mm malloc package using the K-best scheme */
     for (i=0; i < num_tracefiles; i++) {
+	if (stream) {
+	    eval_mm_stream(tracedir, tracefiles[i], i, &ranges, &mm_stats[i]);
+	    continue;
+	}
 	trace = read_trace(tracedir, tracefiles[i]);
 	mm_stats[i].ops = trace->num_ops;
 	if (verbose > 1)
@@ -301,9 +435,20 @@ int main(int argc, char **argv)
 	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
 	    speed_params.trace = trace;
 	    speed_params.ranges = ranges;
-	    if (verbose > 1)
+	    if (verbose > 1) {
 		printf("and performance.\n");
+		printheapstats(&trace->peak_heap);
+	    }
 	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    if (lat_stats != NULL)
+		eval_mm_latency(trace, &lat_stats[i]);
+#ifdef MM_THREAD_SAFE
+	    if (mt_stats != NULL) {
+		if (verbose > 1)
+		    printf("Replaying on %d threads.\n", nthreads);
+		eval_mm_threads(trace, i, &mt_stats[i]);
+	    }
+#endif
 	}
 	free_trace(trace);
     }
@@ -314,6 +459,20 @@ int main(int argc, char **argv)
 	printresults(num_tracefiles, mm_stats);
 	printf("\n");
     }
+    if (lat_stats != NULL) {
+	printf("Latency of mm malloc requests (ns):\n");
+	printlatency(num_tracefiles, lat_stats);
+	printf("\n");
+    }
+#ifdef MM_THREAD_SAFE
+    if (mt_stats != NULL) {
+	printf("Results for mm malloc on %d threads%s%s:\n", nthreads,
+	       partition ? ", partitioned" : "",
+	       cross_free ? ", cross-thread frees" : "");
+	printthreads(num_tracefiles, mt_stats);
+	printf("\n");
+    }
+#endif
 
     /* 
      * Accumulate the aggregate statistics for the student's mm package 
@@ -368,16 +527,131 @@ int main(int argc, char **argv)
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range tree, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks.  The tree
+ * is an AVL tree ordered by payload address, so each check, insertion
+ * and removal takes O(log n) time in the number of live blocks.
  ****************************************************************/
 
+/* range_height - Height of the subtree rooted at p */
+static int range_height(range_t *p)
+{
+    return (p == NULL) ? 0 : p->height;
+}
+
+/* range_fix - Recompute the height of p from its children */
+static void range_fix(range_t *p)
+{
+    int lh = range_height(p->left);
+    int rh = range_height(p->right);
+
+    p->height = 1 + ((lh > rh) ? lh : rh);
+}
+
+/* range_rotate_right - Rotate the subtree rooted at p to the right */
+static range_t *range_rotate_right(range_t *p)
+{
+    range_t *q = p->left;
+
+    p->left = q->right;
+    q->right = p;
+    range_fix(p);
+    range_fix(q);
+    return q;
+}
+
+/* range_rotate_left - Rotate the subtree rooted at p to the left */
+static range_t *range_rotate_left(range_t *p)
+{
+    range_t *q = p->right;
+
+    p->right = q->left;
+    q->left = p;
+    range_fix(p);
+    range_fix(q);
+    return q;
+}
+
+/* 
+ * range_balance - Restore the balance of the subtree rooted at p after
+ *     one insertion or removal below it, and return its new root 
+ */
+static range_t *range_balance(range_t *p)
+{
+    int diff = range_height(p->left) - range_height(p->right);
+
+    if (diff > 1) {
+	if (range_height(p->left->left) < range_height(p->left->right))
+	    p->left = range_rotate_left(p->left);
+	return range_rotate_right(p);
+    }
+    if (diff < -1) {
+	if (range_height(p->right->right) < range_height(p->right->left))
+	    p->right = range_rotate_right(p->right);
+	return range_rotate_left(p);
+    }
+    range_fix(p);
+    return p;
+}
+
+/* range_insert - Insert node into the subtree rooted at p */
+static range_t *range_insert(range_t *p, range_t *node)
+{
+    if (p == NULL)
+	return node;
+    if (node->lo < p->lo)
+	p->left = range_insert(p->left, node);
+    else
+	p->right = range_insert(p->right, node);
+    return range_balance(p);
+}
+
+/* 
+ * range_unlink_min - Detach the lowest range of the subtree rooted at p
+ *     into *min, and return the subtree's new root 
+ */
+static range_t *range_unlink_min(range_t *p, range_t **min)
+{
+    if (p->left == NULL) {
+	*min = p;
+	return p->right;
+    }
+    p->left = range_unlink_min(p->left, min);
+    return range_balance(p);
+}
+
+/* range_delete - Remove and free the range starting at lo, if any */
+static range_t *range_delete(range_t *p, char *lo)
+{
+    range_t *q;
+
+    if (p == NULL)
+	return NULL;
+    if (lo < p->lo)
+	p->left = range_delete(p->left, lo);
+    else if (lo > p->lo)
+	p->right = range_delete(p->right, lo);
+    else {
+	if (p->right == NULL) {
+	    q = p->left;
+	    free(p);
+	    return q;
+	}
+	p->right = range_unlink_min(p->right, &q);
+	q->left = p->left;
+	q->right = p->right;
+	free(p);
+	p = q;
+    }
+    return range_balance(p);
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we create a range struct for this block and add it to the range tree. 
  */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum)
@@ -396,19 +670,24 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap or a mapping */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+	 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+	!mem_in_map(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
         return 0;
     }
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
+    /* 
+     * The payload must not overlap any other payloads.  The payloads in
+     * the tree are disjoint, so if any overlaps this one, then so does
+     * the one just below lo or the one just above it, and the search
+     * for lo passes through both.
+     */
+    for (p = *ranges;  p != NULL;  p = (lo < p->lo) ? p->left : p->right) {
+        if (lo <= p->hi && hi >= p->lo) {
 	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
 		    lo, hi, p->lo, p->hi);
 	    malloc_error(tracenum, opnum, msg);
@@ -418,37 +697,24 @@ static int add_range(range_t **ranges, char *lo, int size,
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range tree.
      */
     if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
 	unix_error("malloc error in add_range");
-    p->next = *ranges;
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    p->left = p->right = NULL;
+    p->height = 1;
+    *ranges = range_insert(*ranges, p);
     return 1;
 }
 
 /* 
  * remove_range - Free the range record of block whose payload starts at lo 
- *
- * XXX alc: It's unclear what the variable "size" was used for.
  */
 static void remove_range(range_t **ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
-    //int size;
-
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            //size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
-    }
+    *ranges = range_delete(*ranges, lo);
 }
 
 /*
@@ -456,13 +722,13 @@ static void remove_range(range_t **ranges, char *lo)
  */
 static void clear_ranges(range_t **ranges)
 {
-    range_t *p;
-    range_t *pnext;
+    range_t *p = *ranges;
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
-    }
+    if (p == NULL)
+	return;
+    clear_ranges(&p->left);
+    clear_ranges(&p->right);
+    free(p);
     *ranges = NULL;
 }
 
@@ -483,6 +749,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
     unsigned index, size;
     unsigned max_index = 0;
     unsigned op_index;
+    int fd;
 
     if (verbose > 1)
 	printf("Reading tracefile: %s\n", filename);
@@ -491,13 +758,25 @@ static trace_t *read_trace(char *tracedir, char *filename)
     if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
 	unix_error("malloc 1 failed in read_trance");
 	
-    /* Read the trace file header */
     strcpy(path, tracedir);
     strcat(path, filename);
-    if ((tracefile = fopen(path, "r")) == NULL) {
+    if ((fd = open(path, O_RDONLY)) < 0) {
 	sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
     }
+
+    /* A binary trace is replayed straight from its mapping */
+    trace->map = NULL;
+    trace->map_len = 0;
+    if (map_trace(trace, fd, path)) {
+	close(fd);
+	alloc_blocks(trace);
+	return trace;
+    }
+
+    /* Read the trace file header */
+    if ((tracefile = fdopen(fd, "r")) == NULL)
+	unix_error("fdopen failed in read_trace");
     fscanf(tracefile, "%u", &(trace->sugg_heapsize)); /* not used */
     fscanf(tracefile, "%u", &(trace->num_ids));     
     fscanf(tracefile, "%u", &(trace->num_ops));     
@@ -507,16 +786,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
     if ((trace->ops = 
 	 (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
 	unix_error("malloc 2 failed in read_trace");
-
-    /* We'll keep an array of pointers to the allocated blocks here... */
-    if ((trace->blocks = 
-	 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
-	unix_error("malloc 3 failed in read_trace");
-
-    /* ... along with the corresponding byte sizes of each block */
-    if ((trace->block_sizes = 
-	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
-	unix_error("malloc 4 failed in read_trace");
+    alloc_blocks(trace);
     
     /* read every request line in the trace file */
     index = 0;
@@ -557,13 +827,105 @@ static trace_t *read_trace(char *tracedir, char *filename)
     return trace;
 }
 
+/*
+ * map_trace - If the open file fd holds a binary trace, map its records
+ *     into trace->ops and fill in the rest of the header fields. Returns 1
+ *     if the trace was mapped and 0 if fd holds a text trace. Each record
+ *     is checked in one sequential pass, since traces written by
+ *     libtracecap have not been through rep2bin's checks.
+ */
+static int map_trace(trace_t *trace, int fd, char *path)
+{
+    tracehdr_t hdr;
+    struct stat st;
+    unsigned i;
+
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0) {
+	if (lseek(fd, 0, SEEK_SET) < 0)
+	    unix_error("lseek failed in map_trace");
+	return 0;
+    }
+    if (hdr.op_size != sizeof(traceop_t)) {
+	sprintf(msg, "%s was written by a host with a different byte order "
+		"or trace record layout", path);
+	app_error(msg);
+    }
+    if (fstat(fd, &st) < 0)
+	unix_error("fstat failed in map_trace");
+    if ((size_t)st.st_size < sizeof(hdr) + 
+	(size_t)hdr.num_ops * sizeof(traceop_t)) {
+	sprintf(msg, "%s is truncated", path);
+	app_error(msg);
+    }
+
+    trace->sugg_heapsize = hdr.sugg_heapsize;
+    trace->num_ids = hdr.num_ids;
+    trace->num_ops = hdr.num_ops;
+    trace->weight = hdr.weight;
+    trace->map_len = st.st_size;
+    if ((trace->map = mmap(NULL, trace->map_len, PROT_READ, MAP_PRIVATE,
+			   fd, 0)) == MAP_FAILED)
+	unix_error("mmap failed in map_trace");
+    madvise(trace->map, trace->map_len, MADV_SEQUENTIAL);
+    trace->ops = (traceop_t *)((char *)trace->map + sizeof(hdr));
+    for (i = 0; i < trace->num_ops; i++) {
+	if (!trace_op_ok(&trace->ops[i], trace->num_ids)) {
+	    sprintf(msg, "%s: request %u has a bad type, index or size", 
+		    path, i);
+	    app_error(msg);
+	}
+    }
+    return 1;
+}
+
+/*
+ * alloc_blocks - Allocate the arrays that track the blocks of a trace
+ */
+static void alloc_blocks(trace_t *trace)
+{
+    /* We'll keep an array of pointers to the allocated blocks here... */
+    if ((trace->blocks = 
+	 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+	unix_error("malloc 3 failed in read_trace");
+
+    /* ... along with the corresponding byte sizes of each block */
+    if ((trace->block_sizes = 
+	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+	unix_error("malloc 4 failed in read_trace");
+}
+
+/*
+ * grow_blocks - Make room in the block arrays of a streamed trace, whose
+ *     header may understate its number of ids, for id index
+ */
+static void grow_blocks(trace_t *trace, unsigned index)
+{
+    unsigned num_ids = (trace->num_ids > 0) ? trace->num_ids : 1;
+
+    while (num_ids <= index)
+	num_ids *= 2;
+    if ((trace->blocks = 
+	 (char **)realloc(trace->blocks, num_ids * sizeof(char *))) == NULL)
+	unix_error("realloc 1 failed in grow_blocks");
+    if ((trace->block_sizes = 
+	 (size_t *)realloc(trace->block_sizes, 
+			   num_ids * sizeof(size_t))) == NULL)
+	unix_error("realloc 2 failed in grow_blocks");
+    trace->num_ids = num_ids;
+}
+
 /*
  * free_trace - Free the trace record and the three arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were allocated in read_trace(), or 
+ *              unmap the records of a binary trace.
  */
 void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
+    if (trace->map != NULL)   /* free the three arrays... */
+	munmap(trace->map, trace->map_len);
+    else
+	free(trace->ops);
     free(trace->blocks);      
     free(trace->block_sizes);
     free(trace);              /* and the trace record itself... */
@@ -579,17 +941,12 @@ void free_trace(trace_t *trace)
  */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) 
 {
-    unsigned i, j;
-    int index;
-    unsigned size;
-    unsigned oldsize;
-    char *newp;
-    char *oldp;
-    char *p;
-    
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and free any records in the range tree */
     mem_reset_brk();
     clear_ranges(ranges);
+    trace->live_bytes = 0;
+    trace->peak_bytes = 0;
+    trace->peak_op = 0;
 
     /* Call the mm package's init function */
     if (mm_init() < 0) {
@@ -598,26 +955,48 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     }
 
     /* Interpret each operation in the trace in order */
-    for (i = 0;  i < trace->num_ops;  i++) {
-	index = trace->ops[i].index;
-	size = trace->ops[i].size;
+    return valid_ops(trace, tracenum, ranges, trace->ops, trace->num_ops, 0);
+}
 
-        switch (trace->ops[i].type) {
+/*
+ * valid_ops - Check the n requests in ops, which start at request number
+ *     first of the trace, for correctness. Also keeps the high-water mark
+ *     of the payload bytes in trace->peak_bytes, and the request that
+ *     first reached it in trace->peak_op.
+ */
+static int valid_ops(trace_t *trace, int tracenum, range_t **ranges,
+		     traceop_t *ops, unsigned n, unsigned first)
+{
+    unsigned i, j;
+    int index;
+    unsigned size;
+    unsigned oldsize;
+    char *newp;
+    char *oldp;
+    char *p;
+
+    for (i = 0;  i < n;  i++) {
+	index = ops[i].index;
+	size = ops[i].size;
+	if ((unsigned)index >= trace->num_ids)
+	    grow_blocks(trace, index);
+
+        switch (ops[i].type) {
 
         case ALLOC: /* mm_malloc */
 
 	    /* Call the student's malloc */
 	    if ((p = mm_malloc(size)) == NULL) {
-		malloc_error(tracenum, i, "mm_malloc failed.");
+		malloc_error(tracenum, first + i, "mm_malloc failed.");
 		return 0;
 	    }
 	    
 	    /* 
 	     * Test the range of the new block for correctness and add it 
-	     * to the range list if OK. The block must be  be aligned properly,
+	     * to the range tree if OK. The block must be  be aligned properly,
 	     * and must not overlap any currently allocated block. 
 	     */ 
-	    if (add_range(ranges, p, size, tracenum, i) == 0)
+	    if (add_range(ranges, p, size, tracenum, first + i) == 0)
 		return 0;
 	    
 	    /* ADDED: cgw
@@ -630,6 +1009,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    /* Remember region */
 	    trace->blocks[index] = p;
 	    trace->block_sizes[index] = size;
+	    trace->live_bytes += size;
 	    break;
 
         case REALLOC: /* mm_realloc */
@@ -637,15 +1017,15 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    /* Call the student's realloc */
 	    oldp = trace->blocks[index];
 	    if ((newp = mm_realloc(oldp, size)) == NULL) {
-		malloc_error(tracenum, i, "mm_realloc failed.");
+		malloc_error(tracenum, first + i, "mm_realloc failed.");
 		return 0;
 	    }
 	    
-	    /* Remove the old region from the range list */
+	    /* Remove the old region from the range tree */
 	    remove_range(ranges, oldp);
 	    
-	    /* Check new block for correctness and add it to range list */
-	    if (add_range(ranges, newp, size, tracenum, i) == 0)
+	    /* Check new block for correctness and add it to range tree */
+	    if (add_range(ranges, newp, size, tracenum, first + i) == 0)
 		return 0;
 	    
 	    /* ADDED: cgw
@@ -656,8 +1036,8 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
-		malloc_error(tracenum, i, "mm_realloc did not preserve the "
+	      if ((unsigned char)newp[j] != (index & 0xFF)) {
+		malloc_error(tracenum, first + i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
 	      }
@@ -666,6 +1046,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 
 	    /* Remember region */
 	    trace->blocks[index] = newp;
+	    trace->live_bytes += size - trace->block_sizes[index];
 	    trace->block_sizes[index] = size;
 	    break;
 
@@ -675,12 +1056,16 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    p = trace->blocks[index];
 	    remove_range(ranges, p);
 	    mm_free(p);
+	    trace->live_bytes -= trace->block_sizes[index];
 	    break;
 
 	default:
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
-
+	if (trace->live_bytes > trace->peak_bytes) {
+	    trace->peak_bytes = trace->live_bytes;
+	    trace->peak_op = first + i;
+	}
     }
 
     /* As far as we know, this is a valid malloc package */
@@ -779,9 +1164,12 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    app_error("Nonexistent request type in eval_mm_util");
 
         }
+	if (verbose > 1 && i == trace->peak_op)
+	    mm_stats(&trace->peak_heap);
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    /* The heap may have shrunk, so compare against its high-water mark. */
+    return ((double)max_total_size / (double)mem_peakheapsize());
 }
 
 
@@ -791,8 +1179,6 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
  */
 static void eval_mm_speed(void *ptr)
 {
-    unsigned i, index, size, newsize;
-    char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
     /* Reset the heap and initialize the mm package */
@@ -801,20 +1187,34 @@ static void eval_mm_speed(void *ptr)
 	app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
-        switch (trace->ops[i].type) {
+    speed_ops(trace, trace->ops, trace->num_ops);
+}
+
+/*
+ * speed_ops - Replay the n requests in ops as fast as possible
+ */
+static void speed_ops(trace_t *trace, traceop_t *ops, unsigned n)
+{
+    unsigned i, index, size, newsize;
+    char *p, *newp, *oldp, *block;
+
+    for (i = 0;  i < n;  i++) {
+	if ((unsigned)ops[i].index >= trace->num_ids)
+	    grow_blocks(trace, ops[i].index);
+
+        switch (ops[i].type) {
 
         case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
+            index = ops[i].index;
+            size = ops[i].size;
             if ((p = mm_malloc(size)) == NULL)
 		app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
             break;
 
 	case REALLOC: /* mm_realloc */
-	    index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
+	    index = ops[i].index;
+            newsize = ops[i].size;
 	    oldp = trace->blocks[index];
             if ((newp = mm_realloc(oldp,newsize)) == NULL)
 		app_error("mm_realloc error in eval_mm_speed");
@@ -822,14 +1222,343 @@ static void eval_mm_speed(void *ptr)
             break;
 
         case FREE: /* mm_free */
-            index = trace->ops[i].index;
+            index = ops[i].index;
             block = trace->blocks[index];
             mm_free(block);
             break;
 
 	default:
-	    app_error("Nonexistent request type in eval_mm_valid");
+	    app_error("Nonexistent request type in eval_mm_speed");
         }
+    }
+}
+
+/*
+ * eval_mm_stream - Check the correctness, space utilization and speed of
+ *    the mm package on a trace that is streamed from its file rather than
+ *    read into memory first, so that traces of any length can be used.
+ *    The trace is streamed twice: once for correctness and utilization,
+ *    and once more, timed, for speed. The time spent waiting for the
+ *    prefetch thread to decode the next chunk is not counted.
+ */
+static void eval_mm_stream(char *tracedir, char *filename, int tracenum,
+			   range_t **ranges, stats_t *stats)
+{
+    trace_t trace;
+    stream_t *stream;
+    traceop_t *ops;
+    char path[MAXLINE];
+    struct timespec start, end;
+    unsigned n, first;
+
+    strcpy(path, tracedir);
+    strcat(path, filename);
+    if (verbose > 1)
+	printf("Streaming tracefile: %s\n", filename);
+
+    /* Reset the heap and free any records in the range tree */
+    stream = stream_open(path);
+    memset(&trace, 0, sizeof(trace));
+    grow_blocks(&trace, stream_num_ids(stream));
+    mem_reset_brk();
+    clear_ranges(ranges);
+    if (mm_init() < 0) {
+	malloc_error(tracenum, 0, "mm_init failed.");
+	stream_close(stream);
+	free(trace.blocks);
+	free(trace.block_sizes);
+	return;
+    }
+
+    stats->valid = 1;
+    for (first = 0; (ops = stream_next(stream, &n)) != NULL; first += n) {
+	if (!valid_ops(&trace, tracenum, ranges, ops, n, first)) {
+	    stats->valid = 0;
+	    break;
+	}
+    }
+    stream_close(stream);
+    stats->ops = first;
+    if (!stats->valid) {
+	free(trace.blocks);
+	free(trace.block_sizes);
+	return;
+    }
+    stats->util = (double)trace.peak_bytes / (double)mem_peakheapsize();
+
+    /* Stream the trace once more and time the mm package on it */
+    stream = stream_open(path);
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_stream");
+    stats->secs = 0;
+    while ((ops = stream_next(stream, &n)) != NULL) {
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	speed_ops(&trace, ops, n);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stats->secs += (end.tv_sec - start.tv_sec) + 
+	    (end.tv_nsec - start.tv_nsec) / 1e9;
+    }
+    stream_close(stream);
+
+    free(trace.blocks);
+    free(trace.block_sizes);
+}
+
+#ifdef MM_THREAD_SAFE
+/*
+ * xfree_drain - Free every block waiting in queue q and return how many
+ *     there were. Only the queue's consumer may call this.
+ */
+static int xfree_drain(xfree_t *q)
+{
+    unsigned head = q->head;
+    unsigned tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    int n = tail - head;
+
+    for (; head != tail; head++)
+	mm_free(q->slots[head & (XFREE_SLOTS - 1)]);
+    __atomic_store_n(&q->head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+/*
+ * xfree_push - Hand block p to the next thread for freeing. While that
+ *     thread's queue is full we drain our own, so a ring of threads that
+ *     are all waiting on each other still makes progress.
+ */
+static void xfree_push(replay_t *r, char *p)
+{
+    xfree_t *q = r->out;
+    int n;
+
+    while (q->tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) ==
+	   XFREE_SLOTS) {
+	if ((n = xfree_drain(r->in)) == 0)
+	    sched_yield();
+	r->ops += n;
+    }
+    q->slots[q->tail & (XFREE_SLOTS - 1)] = p;
+    __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+}
+
+/* The byte each replay thread stamps on the blocks it allocates */
+#define REPLAY_TAG(tid, index) ((char)((index) + 131 * (tid)))
+
+/*
+ * replay_thread - The body of one thread of a concurrent replay. It
+ *     replays its share of the trace into private block pointers and
+ *     checks that no other thread wrote over the blocks it owns.
+ */
+static void *replay_thread(void *ptr)
+{
+    replay_t *r = (replay_t *)ptr;
+    trace_t *trace = r->trace;
+    struct timespec start, end;
+    unsigned i;
+    int index, n;
+    char *p;
+
+    pthread_barrier_wait(&replay_barrier);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	if (partition && index % nthreads != r->tid)
+	    continue;
+	if (cross_free)
+	    r->ops += xfree_drain(r->in);
+
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+	    if ((p = mm_malloc(trace->ops[i].size)) == NULL) {
+		r->failed = i;
+		goto done;
+	    }
+	    p[0] = REPLAY_TAG(r->tid, index);
+	    r->blocks[index] = p;
+	    r->ops++;
+	    break;
+
+	case REALLOC: /* mm_realloc */
+	    p = r->blocks[index];
+	    if (p[0] != REPLAY_TAG(r->tid, index))
+		r->corrupt++;
+	    if ((p = mm_realloc(p, trace->ops[i].size)) == NULL) {
+		r->failed = i;
+		goto done;
+	    }
+	    p[0] = REPLAY_TAG(r->tid, index);
+	    r->blocks[index] = p;
+	    r->ops++;
+	    break;
+
+        case FREE: /* mm_free, here or on the next thread */
+	    p = r->blocks[index];
+	    if (p[0] != REPLAY_TAG(r->tid, index))
+		r->corrupt++;
+	    if (cross_free)
+		xfree_push(r, p);
+	    else {
+		mm_free(p);
+		r->ops++;
+	    }
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in replay_thread");
+        }
+    }
+
+    /* Keep freeing for the previous thread until it has finished too */
+ done:
+    if (cross_free) {
+	__atomic_store_n(&r->out->done, 1, __ATOMIC_RELEASE);
+	while (!__atomic_load_n(&r->in->done, __ATOMIC_ACQUIRE)) {
+	    if ((n = xfree_drain(r->in)) == 0)
+		sched_yield();
+	    r->ops += n;
+	}
+	r->ops += xfree_drain(r->in);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    r->secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return NULL;
+}
+
+/*
+ * eval_mm_threads - Replay a trace on nthreads threads at once to see
+ *     how the mm package scales. Each thread replays the whole trace
+ *     with its own blocks, or only the blocks in its partition under -p;
+ *     under -x each thread's frees are made by the thread after it.
+ */
+static void eval_mm_threads(trace_t *trace, int tracenum, mt_stats_t *stats)
+{
+    pthread_t *tids;
+    replay_t *replays;
+    xfree_t *queues;
+    int t, rc, corrupt = 0;
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_threads");
+
+    tids = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+    replays = (replay_t *)calloc(nthreads, sizeof(replay_t));
+    queues = (xfree_t *)calloc(nthreads, sizeof(xfree_t));
+    stats->kops = (double *)calloc(nthreads, sizeof(double));
+    if (tids == NULL || replays == NULL || queues == NULL || 
+	stats->kops == NULL)
+	unix_error("malloc failed in eval_mm_threads");
+
+    pthread_barrier_init(&replay_barrier, NULL, nthreads);
+    for (t = 0; t < nthreads; t++) {
+	replays[t].trace = trace;
+	replays[t].tid = t;
+	replays[t].failed = -1;
+	if ((replays[t].blocks = 
+	     (char **)calloc(trace->num_ids, sizeof(char *))) == NULL)
+	    unix_error("calloc failed in eval_mm_threads");
+	replays[t].in = &queues[t];
+	replays[t].out = &queues[(t + 1) % nthreads];
+    }
+    for (t = 0; t < nthreads; t++) {
+	if ((rc = pthread_create(&tids[t], NULL, replay_thread, 
+				 &replays[t])) != 0) {
+	    errno = rc;
+	    unix_error("pthread_create failed in eval_mm_threads");
+	}
+    }
+
+    /* The trace runs as long as its slowest thread */
+    stats->valid = 1;
+    stats->ops = 0;
+    stats->secs = 0;
+    for (t = 0; t < nthreads; t++) {
+	pthread_join(tids[t], NULL);
+	stats->ops += replays[t].ops;
+	if (replays[t].secs > stats->secs)
+	    stats->secs = replays[t].secs;
+	stats->kops[t] = (replays[t].ops / 1e3) / replays[t].secs;
+	if (replays[t].failed >= 0)
+	    stats->valid = 0;
+	corrupt += replays[t].corrupt;
+	if (replays[t].failed >= 0) {
+	    sprintf(msg, "mm_malloc or mm_realloc failed on replay thread %d",
+		    t);
+	    malloc_error(tracenum, replays[t].failed, msg);
+	}
+	free(replays[t].blocks);
+    }
+    pthread_barrier_destroy(&replay_barrier);
+
+    stats->valid = (corrupt == 0 && stats->valid);
+    if (corrupt) {
+	errors++;
+	printf("ERROR [trace %d]: %d blocks were overwritten during the "
+	       "concurrent replay\n", tracenum, corrupt);
+    }
+
+    free(tids);
+    free(replays);
+    free(queues);
+}
+#endif
+
+/*
+ * eval_mm_latency - Replay the trace once more, timing every request on
+ *    its own so that the rare slow ones (e.g., those that extend the heap)
+ *    show up in the tail of the distribution instead of in an average.
+ */
+static void eval_mm_latency(trace_t *trace, lat_stats_t *stats)
+{
+    unsigned i, index;
+    struct timespec start, end;
+    char *p;
+
+    for (i = 0; i < 3; i++)
+	lathist_reset(&stats->hist[i]);
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_latency");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+            p = mm_malloc(trace->ops[i].size);
+            break;
+
+	case REALLOC: /* mm_realloc */
+            p = mm_realloc(trace->blocks[index], trace->ops[i].size);
+            break;
+
+        case FREE: /* mm_free */
+            mm_free(trace->blocks[index]);
+            p = NULL;
+            break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_latency");
+	    return;
+        }
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (p == NULL && trace->ops[i].type != FREE)
+	    app_error("mm_malloc or mm_realloc failed in eval_mm_latency");
+	trace->blocks[index] = p;
+	lathist_record(&stats->hist[trace->ops[i].type], 
+		       (end.tv_sec - start.tv_sec) * 1000000000UL + 
+		       end.tv_nsec - start.tv_nsec);
+    }
+    stats->valid = 1;
 }
 
 /*
@@ -981,6 +1710,105 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+#ifdef MM_THREAD_SAFE
+/*
+ * printthreads - prints a summary of the concurrent replays, with the
+ *     aggregate throughput of each trace and that of each of its threads
+ */
+static void printthreads(int n, mt_stats_t *stats)
+{
+    int i, t;
+    double secs = 0;
+    double ops = 0;
+
+    printf("%5s%7s%8s%10s %6s  %s\n", 
+	   "trace", " valid", "ops", "secs", "Kops", "Kops per thread");
+    for (i=0; i < n; i++) {
+	if (!stats[i].valid) {
+	    printf("%2d%10s%8s%10s %6s\n", i, "no", "-", "-", "-");
+	    continue;
+	}
+	printf("%2d%10s%8.0f%10.6f %6.0f ", 
+	       i,
+	       "yes",
+	       stats[i].ops,
+	       stats[i].secs,
+	       (stats[i].ops/1e3)/stats[i].secs);
+	for (t = 0; t < nthreads; t++)
+	    printf(" %.0f", stats[i].kops[t]);
+	printf("\n");
+	secs += stats[i].secs;
+	ops += stats[i].ops;
+    }
+
+    /* Print the aggregate throughput for the set of traces */
+    if (errors == 0)
+	printf("%12s%8.0f%10.6f %6.0f\n", "Total       ", ops, secs,
+	       (ops/1e3)/secs);
+    else
+	printf("%12s%8s%10s %6s\n", "Total       ", "-", "-", "-");
+}
+#endif
+
+/*
+ * printheapstats - prints the allocator's own statistics st, taken at
+ *     the trace's peak payload
+ */
+static void printheapstats(struct mm_stats *st)
+{
+    printf("At peak: heap %lu bytes, %lu live and %lu free blocks, "
+	   "%.0f%% fragmented, %lu extends, %lu splits, %lu coalesces, "
+	   "%lu of %lu reallocs in place.\n",
+	   (unsigned long)st->heap_bytes, (unsigned long)st->live_blocks,
+	   (unsigned long)st->free_blocks, st->fragmentation * 100,
+	   (unsigned long)st->extends, (unsigned long)st->splits,
+	   (unsigned long)st->coalesces, (unsigned long)st->realloc_in_place,
+	   (unsigned long)st->reallocs);
+}
+
+/*
+ * printlatency - prints the latency percentiles of each request type on
+ *     each trace, and over all of the traces
+ */
+static void printlatency(int n, lat_stats_t *stats)
+{
+    static char *names[3] = {"malloc", "free", "realloc"};
+    lathist_t total[3];
+    lathist_t *h;
+    int i, type;
+
+    for (type = 0; type < 3; type++)
+	lathist_reset(&total[type]);
+
+    printf("%5s%8s%8s%8s%8s%8s%8s\n", 
+	   "trace", "op", "count", "p50", "p99", "p999", "max");
+    for (i=0; i <= n; i++) {
+	if (i < n && !stats[i].valid)
+	    continue;
+	for (type = 0; type < 3; type++) {
+	    if (i < n) {
+		h = &stats[i].hist[type];
+		lathist_merge(&total[type], h);
+	    }
+	    else
+		h = &total[type];
+	    if (h->total == 0)
+		continue;
+	    if (i < n)
+		printf("%2d   ", i);
+	    else
+		printf("%-5s", "Total");
+	    printf("%8s%8lu%8lu%8lu%8lu%8lu\n",
+		   names[type],
+		   h->total,
+		   lathist_percentile(h, 50.0),
+		   lathist_percentile(h, 99.0),
+		   lathist_percentile(h, 99.9),
+		   h->max);
+	}
+    }
+}
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -1013,14 +1841,19 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValLspx] [-f <file>] [-t <dir>] [-j <n>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-j <n>     Also replay each trace on <n> threads (mdriver-mt).\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Report latency percentiles of each request type.\n");
+    fprintf(stderr, "\t-p         With -j, split each trace's blocks among the threads.\n");
+    fprintf(stderr, "\t-s         Stream the traces instead of loading them (no -j/-L).\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
+    fprintf(stderr, "\t-x         With -j, free each block on the next thread.\n");
 }
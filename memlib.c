@@ -3,8 +3,11 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE  /* For mremap(). */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 #include <unistd.h>
 #include <sys/mman.h>
@@ -14,24 +17,115 @@
 #include "memlib.h"
 #include "config.h"
 
+/*
+ * The heap lives in a range of virtual memory that is reserved up front
+ * with no access, so reserving even a multi-GB heap costs nothing.  Pages
+ * are committed, made readable and writable, in steps of mem_commit_step
+ * bytes as the break first reaches them.  The size of the reservation is
+ * MAX_HEAP unless the MEM_MAX_HEAP environment variable gives another
+ * (with an optional K, M or G suffix).  If MEM_HUGEPAGES is set to a
+ * nonzero value, the reservation is aligned to HUGEPAGE_SIZE and the
+ * kernel is asked to back it with transparent huge pages.  If it is set
+ * to "hugetlb", the heap is instead mapped from the hugetlbfs pool, falling
+ * back to transparent huge pages if the pool cannot supply the mapping.
+ */
+#define HUGEPAGE_SIZE (2 * (1 << 20))  /* 2 MB */
+#define COMMIT_STEP   (1 << 16)        /* Default commit granularity */
+
 /* private variables */
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_committed;  /* end of the committed part of the heap */
+static size_t mem_commit_step; /* granularity of commits */
+static size_t mem_page;      /* size of the pages backing the heap */
+static int mem_huge;         /* heap is backed by huge pages */
+static size_t mem_peak;      /* largest heap plus mapped size since reset */
+
+/*
+ * Mappings made by mem_map that are still mapped, in a hash table keyed
+ * by start address with linear probing.  The table is kept at most half
+ * full, so finding a mapping takes constant expected time.
+ */
+struct mapping {
+    char *addr;                   /* NULL for an empty slot */
+    size_t size;
+};
+static struct mapping *mem_maps;  /* hash table of mappings */
+static size_t mem_nmaps;          /* number of mappings */
+static size_t mem_maxmaps;        /* slots in mem_maps, a power of two */
+static size_t mem_mapped;         /* total bytes in mappings */
+
+/* The slot where a search for the mapping at addr starts */
+#define MAP_SLOT(addr) \
+    ((((uintptr_t)(addr) >> 12) * 0x9e3779b97f4a7c15ULL) & (mem_maxmaps - 1))
+
+static void mem_update_peak(void);
+static int mem_grow_maps(void);
+static size_t mem_find_map(void *addr);
+static int mem_forget_map(void *addr);
+static size_t mem_getenv_size(const char *name, size_t dflt);
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    size_t max_heap = mem_getenv_size("MEM_MAX_HEAP", MAX_HEAP);
+    size_t align = mem_pagesize();
+    size_t lead;
+    char *hugepages = getenv("MEM_HUGEPAGES");
+    char *reserved = MAP_FAILED;
+
+    mem_commit_step = COMMIT_STEP;
+    mem_page = mem_pagesize();
+    mem_huge = (hugepages != NULL && strcmp(hugepages, "") != 0 &&
+		strcmp(hugepages, "0") != 0);
+    if (mem_huge) {
+	align = HUGEPAGE_SIZE;
+	mem_commit_step = HUGEPAGE_SIZE;
+    }
+    max_heap = (max_heap + align - 1) & ~(align - 1);
+
+    /* reserve the address space we will use to model the available VM */
+    if (mem_huge && strcmp(hugepages, "hugetlb") == 0) {
+	/*
+	 * Without MAP_NORESERVE the pool's pages are set aside now, so a
+	 * pool too small for the whole heap fails here, not at a later
+	 * page fault.  hugetlbfs mappings come aligned, so there is nothing
+	 * to trim.
+	 */
+	reserved = mmap(NULL, max_heap, PROT_NONE, MAP_PRIVATE |
+			MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (reserved != MAP_FAILED) {
+	    mem_page = HUGEPAGE_SIZE;
+	    align = 0;
+	}
+    }
+    if (reserved == MAP_FAILED)
+	reserved = mmap(NULL, max_heap + align, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserved == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
 	exit(1);
     }
 
-    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
+    /* trim the reservation to an aligned range of max_heap bytes */
+    lead = 0;
+    if (align != 0) {
+	lead = (align - (uintptr_t)reserved % align) % align;
+	if (lead > 0)
+	    munmap(reserved, lead);
+	munmap(reserved + lead + max_heap, align - lead);
+    }
+    mem_start_brk = reserved + lead;
+    if (mem_huge && mem_page != HUGEPAGE_SIZE)
+	madvise(mem_start_brk, max_heap, MADV_HUGEPAGE);
+
+    mem_max_addr = mem_start_brk + max_heap;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_committed = mem_start_brk;            /* nothing is committed yet */
+    mem_peak = 0;
 }
 
 /* 
@@ -39,35 +133,312 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    mem_reset_brk();
+    if (mem_maps != NULL)
+	munmap(mem_maps, mem_maxmaps * sizeof(*mem_maps));
+    mem_maps = NULL;
+    mem_nmaps = mem_maxmaps = 0;
+    munmap(mem_start_brk, mem_max_addr - mem_start_brk);
+}
+
+/*
+ * mem_parse_size - store in *sizep the size written in value, which may
+ *    have a K, M or G suffix; return 0 on success and -1 if value is not
+ *    a size or does not fit in a size_t
+ */
+int mem_parse_size(const char *value, size_t *sizep)
+{
+    char *end;
+    size_t size;
+    int shift = 0;
+
+    /* strtoull would accept a sign and negate the value */
+    if (*value == '\0' || value[strspn(value, " \t\n\v\f\r")] == '-')
+	return -1;
+    errno = 0;
+    size = strtoull(value, &end, 0);
+    if (errno == ERANGE)
+	return -1;
+    switch (*end) {
+    case 'G': case 'g':
+	shift += 10;
+	/* FALLTHROUGH */
+    case 'M': case 'm':
+	shift += 10;
+	/* FALLTHROUGH */
+    case 'K': case 'k':
+	shift += 10;
+	end++;
+	break;
+    }
+    if (*end != '\0' || size > (SIZE_MAX >> shift))
+	return -1;
+    *sizep = size << shift;
+    return 0;
+}
+
+/*
+ * mem_getenv_size - return the size given by environment variable name,
+ *    which may have a K, M or G suffix, or dflt if it is not set
+ */
+static size_t mem_getenv_size(const char *name, size_t dflt)
+{
+    char *value = getenv(name);
+    size_t size;
+
+    if (value == NULL || *value == '\0')
+	return dflt;
+    if (mem_parse_size(value, &size) == -1 || size == 0) {
+	fprintf(stderr, "mem_init_vm: bad %s \"%s\"\n", name, value);
+	exit(1);
+    }
+    return size;
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *    and remove any mappings that are left
  */
 void mem_reset_brk()
 {
+    size_t i;
+
+    for (i = 0; i < mem_maxmaps; i++) {
+	if (mem_maps[i].addr != NULL)
+	    munmap(mem_maps[i].addr, mem_maps[i].size);
+	mem_maps[i].addr = NULL;
+    }
+    mem_nmaps = 0;
+    mem_mapped = 0;
     mem_brk = mem_start_brk;
+    mem_peak = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A
+ *    negative incr shrinks the heap, and the pages no longer in the
+ *    heap are returned to the system.
  */
 void *mem_sbrk(intptr_t incr) 
 {
     char *old_brk = mem_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if (incr < 0 && mem_brk + incr < mem_start_brk) {
+	errno = EINVAL;
+	fprintf(stderr, "ERROR: mem_sbrk failed. Shrunk below heap start...\n");
+	return (void *)-1;
+    }
+    if ((mem_brk + incr) > mem_max_addr) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
+    if (mem_brk + incr > mem_committed) {
+	/* commit the pages the break is about to reach */
+	char *commit = mem_start_brk + ((mem_brk + incr - mem_start_brk +
+	    mem_commit_step - 1) & ~(mem_commit_step - 1));
+
+	if (commit > mem_max_addr)
+	    commit = mem_max_addr;
+	if (mprotect(mem_committed, commit - mem_committed,
+		     PROT_READ | PROT_WRITE) == -1) {
+	    fprintf(stderr, "ERROR: mem_sbrk failed. Could not commit memory...\n");
+	    return (void *)-1;
+	}
+	mem_committed = commit;
+    }
     mem_brk += incr;
+    if (incr < 0)
+	mem_release(mem_brk, -incr);
+    mem_update_peak();
     return (void *)old_brk;
 }
 
+/*
+ * mem_release - tell the system that the bytes in [addr, addr + len) hold
+ *    no data, so that the whole pages among them can be reclaimed.  The
+ *    pages read as zero if they are touched again.
+ */
+void mem_release(void *addr, size_t len)
+{
+    uintptr_t pagesize = mem_page;
+    uintptr_t lo = ((uintptr_t)addr + pagesize - 1) & ~(pagesize - 1);
+    uintptr_t hi = ((uintptr_t)addr + len) & ~(pagesize - 1);
+
+    if (lo < hi)
+	madvise((void *)lo, hi - lo, MADV_DONTNEED);
+}
+
+/*
+ * mem_map - map size bytes of zeroed memory outside the heap, for blocks
+ *    too large to carve from it.  size must be a multiple of the page
+ *    size.  Returns the start of the mapping, or NULL on failure.
+ */
+void *mem_map(size_t size)
+{
+    char *addr;
+    size_t i;
+
+    if (2 * (mem_nmaps + 1) > mem_maxmaps && mem_grow_maps() < 0)
+	return NULL;
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+	return NULL;
+    for (i = MAP_SLOT(addr); mem_maps[i].addr != NULL; 
+	 i = (i + 1) & (mem_maxmaps - 1))
+	;
+    mem_maps[i].addr = addr;
+    mem_maps[i].size = size;
+    mem_nmaps++;
+    mem_mapped += size;
+    mem_update_peak();
+    return addr;
+}
+
+/*
+ * mem_grow_maps - double the slots in the mapping table, or create it.
+ *    Returns 0 on success and -1 on failure.
+ */
+static int mem_grow_maps(void)
+{
+    struct mapping *old = mem_maps, *maps;
+    size_t old_max = mem_maxmaps, max, i, j;
+
+    /*
+     * The table is itself mapped, not taken from malloc, so that this
+     * module also works beneath a malloc that replaces the C library's.
+     */
+    max = (old_max == 0) ? 256 : 2 * old_max;
+    maps = mmap(NULL, max * sizeof(*maps), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (maps == MAP_FAILED)
+	return -1;
+    mem_maps = maps;
+    mem_maxmaps = max;
+    for (i = 0; i < old_max; i++) {
+	if (old[i].addr == NULL)
+	    continue;
+	for (j = MAP_SLOT(old[i].addr); maps[j].addr != NULL; 
+	     j = (j + 1) & (max - 1))
+	    ;
+	maps[j] = old[i];
+    }
+    if (old != NULL)
+	munmap(old, old_max * sizeof(*old));
+    return 0;
+}
+
+/*
+ * mem_find_map - return the slot of the mapping starting at addr, or
+ *    mem_maxmaps if there is none
+ */
+static size_t mem_find_map(void *addr)
+{
+    size_t i;
+
+    if (mem_maxmaps == 0)
+	return 0;
+    for (i = MAP_SLOT(addr); mem_maps[i].addr != NULL; 
+	 i = (i + 1) & (mem_maxmaps - 1))
+	if (mem_maps[i].addr == addr)
+	    return i;
+    return mem_maxmaps;
+}
+
+/*
+ * mem_remap - resize the mapping of old_size bytes at addr to new_size
+ *    bytes, moving it if it cannot be resized in place.  Returns the new
+ *    start of the mapping, or NULL on failure, in which case the old
+ *    mapping is left unchanged.
+ */
+void *mem_remap(void *addr, size_t old_size, size_t new_size)
+{
+    char *new_addr;
+    size_t i;
+
+    if (mem_find_map(addr) == mem_maxmaps)
+	return NULL;
+    new_addr = mremap(addr, old_size, new_size, MREMAP_MAYMOVE);
+    if (new_addr == MAP_FAILED)
+	return NULL;
+    mem_forget_map(addr);
+    for (i = MAP_SLOT(new_addr); mem_maps[i].addr != NULL; 
+	 i = (i + 1) & (mem_maxmaps - 1))
+	;
+    mem_maps[i].addr = new_addr;
+    mem_maps[i].size = new_size;
+    mem_nmaps++;
+    mem_mapped = mem_mapped - old_size + new_size;
+    mem_update_peak();
+    return new_addr;
+}
+
+/*
+ * mem_unmap - remove the mapping of size bytes at addr made by mem_map.
+ *    Returns 0 on success and -1 if addr is not such a mapping.
+ */
+int mem_unmap(void *addr, size_t size)
+{
+    if (mem_forget_map(addr) < 0)
+	return -1;
+    munmap(addr, size);
+    mem_mapped -= size;
+    return 0;
+}
+
+/*
+ * mem_forget_map - remove the mapping at addr from the table, moving
+ *    back the entries after it that would no longer be found.  Returns
+ *    0 on success and -1 if addr is not in the table.
+ */
+static int mem_forget_map(void *addr)
+{
+    size_t i, j, k;
+
+    if ((i = mem_find_map(addr)) == mem_maxmaps)
+	return -1;
+    for (j = (i + 1) & (mem_maxmaps - 1); mem_maps[j].addr != NULL;
+	 j = (j + 1) & (mem_maxmaps - 1)) {
+	/* Entry j may fill the hole at i unless its home lies in (i, j] */
+	k = MAP_SLOT(mem_maps[j].addr);
+	if (((j - k) & (mem_maxmaps - 1)) >= ((j - i) & (mem_maxmaps - 1))) {
+	    mem_maps[i] = mem_maps[j];
+	    i = j;
+	}
+    }
+    mem_maps[i].addr = NULL;
+    mem_nmaps--;
+    return 0;
+}
+
+/*
+ * mem_in_map - return true if [lo, hi] lies within the mapping that
+ *    starts at the page holding lo.  A payload served from a mapping
+ *    begins in its first page, so the mapping is found by hashing.
+ */
+int mem_in_map(void *lo, void *hi)
+{
+    char *addr = (char *)((uintptr_t)lo & ~(uintptr_t)(mem_pagesize() - 1));
+    size_t i;
+
+    if ((i = mem_find_map(addr)) == mem_maxmaps)
+	return 0;
+    return (char *)hi < mem_maps[i].addr + mem_maps[i].size;
+}
+
+/*
+ * mem_update_peak - fold the current heap and mapped size into mem_peak
+ */
+static void mem_update_peak(void)
+{
+    size_t size = mem_heapsize() + mem_mapped;
+
+    if (size > mem_peak)
+	mem_peak = size;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -92,6 +463,40 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_mapsize() - returns the number of bytes in mappings
+ */
+size_t mem_mapsize()
+{
+    return mem_mapped;
+}
+
+/*
+ * mem_peakheapsize() - returns the largest number of bytes held in the
+ *    heap and mappings together since the last reset
+ */
+size_t mem_peakheapsize()
+{
+    return mem_peak;
+}
+
+/*
+ * mem_maxheapsize() - returns the largest size the heap may grow to
+ */
+size_t mem_maxheapsize()
+{
+    return (size_t)(mem_max_addr - mem_start_brk);
+}
+
+/*
+ * mem_hugepagesize() - returns the size of the huge pages backing the
+ *    heap, or 0 if the heap is not backed by huge pages
+ */
+size_t mem_hugepagesize()
+{
+    return mem_huge ? HUGEPAGE_SIZE : 0;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -1,8 +1,18 @@
 void mem_init(void);               
 void mem_deinit(void);
 void *mem_sbrk(intptr_t incr);
+void mem_release(void *addr, size_t len);
+void *mem_map(size_t size);
+void *mem_remap(void *addr, size_t old_size, size_t new_size);
+int mem_unmap(void *addr, size_t size);
+int mem_in_map(void *lo, void *hi);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_mapsize(void);
+size_t mem_peakheapsize(void);
+size_t mem_maxheapsize(void);
 size_t mem_pagesize(void);
+size_t mem_hugepagesize(void);
+int mem_parse_size(const char *value, size_t *sizep);
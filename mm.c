@@ -12,11 +12,22 @@
  * type uintptr_t to define unsigned integers that are the same size
  * as a pointer, i.e., sizeof(uintptr_t) == sizeof(void *).
  */
+#ifdef MM_THREAD_SAFE
+#define _GNU_SOURCE  /* For sched_getcpu(). */
+#endif
+
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+
+#ifdef MM_THREAD_SAFE
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
 
 #include "memlib.h"
 #include "mm.h"
@@ -41,11 +52,50 @@ team_t team = {
 /* Basic constants and macros: */
 #define WSIZE      sizeof(void *) /* Word and header/footer size (bytes) */
 #define DSIZE      (2 * WSIZE)    /* Doubleword size (bytes) */
-#define CHUNKSIZE  (1 << 11)      /* Extend heap by this amount (bytes) */
-#define NUM_SEG (16)              /* Number of segments of freelists */
+#define CHUNKSIZE  (1 << 11)      /* Smallest heap extension (bytes) */
+#define GROW_MAX   (1 << 21)      /* Largest adaptive heap extension */
+#define GROW_FRACTION 64          /* Extensions adapt up to 1/64 of an arena */
+#define MINBLOCK   (2 * DSIZE)    /* Minimum block size (bytes) */
+#define REALLOC_GROWTH 133        /* Percent a moved realloc block grows */
+#define TRIM_THRESHOLD 0          /* Free top block that triggers a trim */
+#define TRIM_PAD   (1 << 17)      /* Free bytes a trim keeps at the top */
+#define MMAP_THRESHOLD (1 << 18)  /* Smallest request given its own mapping */
 #define MAX(x, y)  ((x) > (y) ? (x) : (y))  
 #define MIN(x, y)  ((x) < (y) ? (x) : (y))  
 
+/*
+ * Tunables, indexed by the mm_config parameters in mm.h.  Each starts at
+ * the default above, is overridden by the environment variable of the
+ * same name when mm_init first runs, and can be changed by mm_config.
+ */
+static size_t tune[MM_NPARAMS] = {
+	[MM_CHUNK_SIZE] = CHUNKSIZE,
+	[MM_GROW_MAX] = GROW_MAX,
+	[MM_SPLIT_MIN] = MINBLOCK,
+	[MM_REALLOC_GROWTH] = REALLOC_GROWTH,
+	[MM_TRIM_THRESHOLD] = TRIM_THRESHOLD,
+	[MM_TRIM_PAD] = TRIM_PAD,
+	[MM_MMAP_THRESHOLD] = MMAP_THRESHOLD,
+};
+static const char *const tune_names[MM_NPARAMS] = {
+	[MM_CHUNK_SIZE] = "MM_CHUNK_SIZE",
+	[MM_GROW_MAX] = "MM_GROW_MAX",
+	[MM_SPLIT_MIN] = "MM_SPLIT_MIN",
+	[MM_REALLOC_GROWTH] = "MM_REALLOC_GROWTH",
+	[MM_TRIM_THRESHOLD] = "MM_TRIM_THRESHOLD",
+	[MM_TRIM_PAD] = "MM_TRIM_PAD",
+	[MM_MMAP_THRESHOLD] = "MM_MMAP_THRESHOLD",
+};
+static bool tune_loaded;	/* The environment has been read */
+
+/*
+ * Payload alignment.  The driver needs only ALIGNMENT, but a build that
+ * stands in for the C library's malloc must match its 16-byte guarantee.
+ */
+#ifndef MM_ALIGNMENT
+#define MM_ALIGNMENT  WSIZE
+#endif
+
 /* Pack a size and allocated bit into a word. */
 #define PACK(size, alloc)  ((size) | (alloc))
 
@@ -57,40 +107,339 @@ team_t team = {
 #define GET_SIZE(p)   (GET(p) & ~(WSIZE - 1))
 #define GET_ALLOC(p)  (GET(p) & 0x1)
 
+/*
+ * Only free blocks have footers.  Instead, every header carries a PREVFREE
+ * bit that is set exactly when the block before it is free, so that
+ * PREV_BLKP is only used when that block's footer exists.
+ */
+#define PREVFREE         0x2
+#define GET_PREVFREE(p)  (GET(p) & PREVFREE)
+
+/* Write the header of block bp, keeping its PREVFREE bit. */
+#define PUT_HDR(bp, val)  (PUT(HDRP(bp), (val) | GET_PREVFREE(HDRP(bp))))
+
+/* Set or clear the PREVFREE bit in the header of block bp. */
+#define SET_PREVFREE(bp)  (PUT(HDRP(bp), GET(HDRP(bp)) | PREVFREE))
+#define CLR_PREVFREE(bp)  (PUT(HDRP(bp), GET(HDRP(bp)) & ~PREVFREE))
+
+/*
+ * A block of at least MMAP_THRESHOLD bytes lives alone in its own mapping
+ * outside the heap.  Its header holds the length of the mapping, and its
+ * arena index is MAPPED_ARENA.
+ */
+#define MAPPED_ARENA    ((uintptr_t) -1)
+#define IS_MAPPED(bp)   (GET(HDRLINK(bp)) == MAPPED_ARENA)
+
 /* Get/put neighboring blocks in the free list. */
 #define GET_NEXT_FREE(p) (GET(p + WSIZE))
 #define PUT_NEXT_FREE(p, val) (PUT(p + WSIZE, val))
 #define GET_PREV_FREE(p) (GET(p + WSIZE))
 #define PUT_PREV_FREE(p, val) (PUT(p + WSIZE, val))
 
-/* Given block ptr bp, compute address of its header and footer. */
+/* Given block ptr bp, compute address of its header and free footer. */
 #define HDRP(bp)  ((char *)(bp) - DSIZE)
 #define FTRP(bp)  ((char *)(bp) + GET_SIZE(HDRP(bp)) - 2 * DSIZE)
 #define HDRLINK(bp)  ((char *)(bp) - WSIZE)
 
-/* Given block ptr bp, compute address of next and previous blocks. */
+/* Given block ptr bp, compute address of next and previous free blocks. */
 #define NEXT_BLKP(bp)  ((char *)(bp) + GET_SIZE(((char *)(bp) - DSIZE)))
 #define PREV_BLKP(bp)  ((char *)(bp) - GET_SIZE(((char *)(bp) - 2 * DSIZE)))
 
 /* Fast floor(log2(x)) from https://stackoverflow.com/a/10538937/2731457 */
 #define FAST_LOG2(x) (63U - __builtin_clzl((unsigned long)(x)))
 
+/*
+ * Free blocks are segregated by size.  Below 2^SPLIT_LOG2 bytes there is
+ * one class per power of two.  From there up to 2^TOP_LOG2 bytes each power
+ * of two is split TLSF-style into SPLIT_COUNT classes of equal width, so the
+ * first block of any class above a request's class is known to fit it.  All
+ * blocks of 2^TOP_LOG2 bytes or more share the last class.  Each arena keeps
+ * a bitmap of its non-empty classes.
+ *
+ * The last class is a treap instead of a list, giving best fit among large
+ * blocks.  Its head is the root, and each of its blocks keeps its left and
+ * right children in the first two words of its payload.  Blocks are ordered
+ * by size and then by address, and a block's priority is a hash of its
+ * address, so the tree is balanced in expectation without storing anything
+ * else.
+ */
+#define SPLIT_LOG2   9              /* First power of two that is split */
+#define SPLIT_BITS   2              /* log2 of the classes per power */
+#define SPLIT_COUNT  (1 << SPLIT_BITS)
+#define TOP_LOG2     15             /* First size in the last class */
+#define NUM_SEG      (SPLIT_LOG2 + (TOP_LOG2 - SPLIT_LOG2) * SPLIT_COUNT + 1)
+
+/* Child links, priority and order of a block in the last class's treap. */
+#define TREE_LEFT(bp)   ((char *)(bp))
+#define TREE_RIGHT(bp)  ((char *)(bp) + WSIZE)
+#define TREE_PRIO(bp)   ((uint64_t) (uintptr_t) (bp) * 0x9e3779b97f4a7c15ULL)
+#define TREE_LESS(x, y)  (GET_SIZE(HDRP(x)) < GET_SIZE(HDRP(y)) || \
+    (GET_SIZE(HDRP(x)) == GET_SIZE(HDRP(y)) && (char *)(x) < (char *)(y)))
+
+/*
+ * Requests of up to SLAB_MAX bytes are served from slab runs instead of
+ * blocks.  A run is an allocated block whose payload is a power of two
+ * between RUN_MIN and RUN_MAX bytes, aligned to its size; it starts with a
+ * struct run and is otherwise packed with headerless objects of one size
+ * class.  slab_map has a byte for each RUN_MIN bytes of the heap that is
+ * the log2 of the size of the run covering them, or zero if there is
+ * none, so any payload pointer can be mapped back to its run.
+ *
+ * A run costs its whole payload however few of its objects are in use, so
+ * each class's first run is only RUN_MIN bytes, and each further run it
+ * needs is twice the size of the last, up to RUN_MAX.
+ */
+#define SLAB_MAX      64           /* Largest request served by a slab */
+#define SLAB_QUANTUM  MM_ALIGNMENT /* Spacing of the slab size classes */
+#define SLAB_CLASSES  ((int) (SLAB_MAX / SLAB_QUANTUM))
+#define RUN_MIN_LOG2  9            /* log2 of the smallest run */
+#define RUN_MAX_LOG2  12           /* log2 of the largest run */
+#define RUN_MIN       (1 << RUN_MIN_LOG2)
+#define RUN_MAX       (1 << RUN_MAX_LOG2)
+
+/* Index in slab_map of the RUN_MIN bytes holding address p. */
+#define SLAB_PAGE(p)  ((uintptr_t) (p) / RUN_MIN - \
+    (uintptr_t) heap_lo / RUN_MIN)
+
+/* Size class of a request, and object size of a class. */
+#define SLAB_CLASS(size)  ((int) (((size) - 1) / SLAB_QUANTUM))
+#define SLAB_SIZE(cls)    ((size_t) ((cls) + 1) * SLAB_QUANTUM)
+
+/* Header at the start of every slab run. */
+struct run {
+	struct run *next;          /* Arena's runs of this class with */
+	struct run *prev;          /*   free objects, doubly linked */
+	void *free;                /* Free objects, linked through payload */
+	unsigned short nfree;      /* Number of free objects */
+	unsigned short nobjs;      /* Number of objects in the run */
+	unsigned short cls;        /* Size class */
+};
+
+/* Offset of the first object in a run. */
+#define RUN_HDR  ((sizeof(struct run) + SLAB_QUANTUM - 1) & \
+    ~(SLAB_QUANTUM - 1))
+
+/*
+ * A region is a list of chunks, each an allocated block whose payload
+ * starts with a struct chunk and is otherwise handed out by bumping a
+ * pointer.  Objects have no headers and are never freed one at a time;
+ * destroying the region frees each chunk as a single block.  The struct
+ * mm_region itself is the first object of the region's oldest chunk.
+ * Chunks double in size from REGION_CHUNK up to REGION_CHUNK_MAX, and an
+ * object of more than a quarter of the next chunk gets a chunk of its own
+ * so that the chunk being bumped is not abandoned half used.
+ */
+#define REGION_CHUNK      (1 << 13)  /* Payload of a region's first chunk */
+#define REGION_CHUNK_MAX  (1 << 17)  /* Largest chunk a region grows to */
+
+/* Header at the start of every region chunk. */
+struct chunk {
+	struct chunk *next;        /* Next older chunk of the region */
+};
+
+/* Offset of the first object in a chunk. */
+#define CHUNK_HDR  ((sizeof(struct chunk) + MM_ALIGNMENT - 1) & \
+    ~(MM_ALIGNMENT - 1))
+
+/* An object size rounded up to keep the next object aligned. */
+#define REGION_ALIGN(size)  (((size) + MM_ALIGNMENT - 1) & \
+    ~(size_t) (MM_ALIGNMENT - 1))
+
+struct mm_region {
+	struct chunk *chunks;      /* Bump chunk, then all the others */
+	char *cur;                 /* Next free byte of the bump chunk */
+	char *end;                 /* End of the bump chunk */
+	size_t grow;               /* Payload of the next bump chunk */
+	struct arena *arena;       /* Arena the chunks come from */
+};
+
+/*
+ * The heap is divided into arenas.  Each arena is an independent heap with
+ * its own prologue holding its segregated list heads, and it grows by
+ * claiming segments from mem_sbrk.  When an arena's last segment no longer
+ * ends at the break, because another arena has grown since, the arena
+ * starts a new segment: an allocated fence block followed by the new free
+ * block and an epilogue.  Every allocated block, fence and prologue records
+ * its arena's index in the second header word, so a block is always freed
+ * back to the arena that owns it.
+ */
+#ifdef MM_THREAD_SAFE
+#define MAX_ARENAS 64
+#else
+#define MAX_ARENAS 1
+#endif
+
+/* Event counts kept by each arena since mm_init, for mm_stats. */
+struct arena_stats {
+	size_t extends;            /* Heap extensions */
+	size_t splits;             /* Free blocks split to place a request */
+	size_t coalesces;          /* Free blocks merged with a neighbor */
+	size_t reallocs;           /* mm_realloc calls on a block */
+	size_t realloc_moves;      /* ... that had to copy to a new block */
+};
+
+struct arena {
+	char *seg_listp;           /* Segregated list heads (prologue bp) */
+	char *last_seg;            /* Prologue or fence of newest segment */
+	char *end;                 /* End of the newest segment */
+	size_t size;               /* Bytes obtained from mem_sbrk */
+	size_t grow;               /* Size of the next heap extension */
+	unsigned long seg_map;     /* Bit i set if class i is non-empty */
+	struct run *runs[SLAB_CLASSES]; /* Runs with free objects */
+	unsigned char run_log2[SLAB_CLASSES]; /* log2 of each next run */
+	size_t check_ops;          /* Checks since the last full check */
+	size_t check_period;       /* Checks between full checks */
+	struct arena_stats stats;  /* Event counts */
+#ifdef MM_THREAD_SAFE
+	pthread_mutex_t lock;      /* Protects every block in the arena */
+#endif
+};
+
+/*
+ * Count n events in arena "a".  The realloc counts are kept in the calling
+ * thread's home arena, whose lock is not held, so in the thread-safe build
+ * they are relaxed atomic adds; home arenas are per CPU, so these rarely
+ * contend.  Every other count is made under the arena's lock.
+ */
+#ifdef MM_THREAD_SAFE
+#define STAT_ADD(a, field, n) \
+    __atomic_fetch_add(&(a)->stats.field, (n), __ATOMIC_RELAXED)
+#else
+#define STAT_ADD(a, field, n)  ((a)->stats.field += (n))
+#endif
+
+_Static_assert(NUM_SEG == MM_NCLASSES, "MM_NCLASSES must match NUM_SEG");
+
+/* Arena index of an allocated block, fence or prologue. */
+#define GET_ARENA(bp)  (&arenas[GET(HDRLINK(bp))])
+#define ARENA_INDEX(a) ((uintptr_t) ((a) - arenas))
+
+/*
+ * Thread-safe mode.  When built with -DMM_THREAD_SAFE, each arena has its
+ * own lock and threads are spread over up to one arena per CPU.  Each
+ * thread also keeps a small cache ("tcache") of allocated blocks of up to
+ * TCACHE_MAX bytes.  Blocks in a tcache stay marked as allocated, so they
+ * are never coalesced; they only return to their arena's segregated lists
+ * when a bin overflows or the thread exits.
+ */
+#ifdef MM_THREAD_SAFE
+#define TCACHE_MAX   (1 << 9)   /* Largest block size cached per thread */
+#define TCACHE_BINS  (SLAB_CLASSES + (int) ((TCACHE_MAX - MINBLOCK) / WSIZE) + 1)
+#define TCACHE_FILL  16         /* Maximum blocks held in one bin */
+#define TCACHE_BATCH 8          /* Blocks moved per refill or flush */
+
+/* The first SLAB_CLASSES bins cache slab objects, the rest whole blocks. */
+#define TCACHE_IDX(size)  (SLAB_CLASSES + (int) (((size) - MINBLOCK) / WSIZE))
+
+#define ARENA_LOCK(a)    pthread_mutex_lock(&(a)->lock)
+#define ARENA_UNLOCK(a)  pthread_mutex_unlock(&(a)->lock)
+#define SBRK_LOCK()      pthread_mutex_lock(&sbrk_lock)
+#define SBRK_UNLOCK()    pthread_mutex_unlock(&sbrk_lock)
+
+/* Per-thread cache: singly linked bins of same-size allocated objects. */
+struct tcache {
+	unsigned long epoch;            /* heap_epoch when bins were filled */
+	struct arena *arena;            /* This thread's home arena */
+	void *bins[TCACHE_BINS];        /* Bin heads, linked through payload */
+	int counts[TCACHE_BINS];        /* Number of blocks in each bin */
+};
+
+static pthread_mutex_t sbrk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key;       /* Flushes the tcache at exit */
+static unsigned long heap_epoch;       /* Bumped by every mm_init */
+static unsigned long next_arena;       /* Round-robin arena assignment */
+static __thread struct tcache tcache;
+#else
+#define ARENA_LOCK(a)    ((void)(a))
+#define ARENA_UNLOCK(a)  ((void)(a))
+#define SBRK_LOCK()
+#define SBRK_UNLOCK()
+#endif
+
 /* Global variables: */
-static char *heap_listp; /* Pointer to first block */  
+#ifdef MM_THREAD_SAFE
+static struct arena arenas[MAX_ARENAS] = {
+	[0 ... MAX_ARENAS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+#else
+static struct arena arenas[MAX_ARENAS]; /* Arena 0 is created by mm_init */
+#endif
+static int narenas;                     /* Number of arenas in use */
+static char *heap_lo;                   /* First byte of the heap */
+static unsigned char *slab_map;         /* Size of the run at each spot */
+static size_t slab_map_size;            /* Bytes in slab_map */
 
 /* Function prototypes for internal helper routines: */
-static void *coalesce(void *bp);
-static void *extend_heap(size_t words);
-static void *find_fit(size_t asize);
-static void place(void *bp, size_t asize);
-static void seg_block(void *bp);
-static void remove_freelist(void *bp);
+static int arena_init(struct arena *a);
+static struct arena *arena_get(void);
+static void *coalesce(struct arena *a, void *bp);
+static void *extend_heap(struct arena *a, size_t words);
+static size_t grow_size(struct arena *a, size_t asize);
+static void *find_fit(struct arena *a, size_t asize);
+static void place(struct arena *a, void *bp, size_t asize);
+static void *heap_alloc(struct arena *a, size_t asize);
+static void heap_free(struct arena *a, void *bp);
+static size_t adjust_size(size_t size);
+static void sort_ptrs(void **ptrs, size_t n);
+static bool heap_grow(struct arena *a, size_t incr);
+static void realloc_absorb(struct arena *a, void *bp, void *end);
+static void realloc_split(struct arena *a, void *bp, size_t asize);
+static size_t arena_trim(struct arena *a, size_t pad);
+static void *map_alloc(size_t size);
+static void map_free(void *bp);
+static void *map_realloc(void *bp, size_t size);
+static int get_seg_index(size_t size);
+static void *get_segregation(struct arena *a, size_t size);
+static void seg_block(struct arena *a, void *bp);
+static void remove_freelist(struct arena *a, void *bp);
+static void tree_insert(void *link, void *bp);
+static void tree_remove(void *link, void *bp);
+static void *tree_fit(void *link, size_t asize);
+static void *heap_alloc_aligned(struct arena *a, size_t asize,
+    size_t align);
+static size_t aligned_lead(void *bp, size_t align);
+static struct run *slab_run(void *bp);
+static void *slab_alloc(struct arena *a, int cls);
+static void slab_free(struct arena *a, struct run *r, void *obj);
+static struct run *run_create(struct arena *a, int cls);
+static void run_destroy(struct arena *a, struct run *r);
+static struct chunk *chunk_alloc(struct arena *a, size_t size);
+static void *region_grow(struct mm_region *rg, size_t size);
+static size_t place_batch(struct arena *a, void *bp, size_t asize,
+    void **out, size_t n);
+#ifdef MM_THREAD_SAFE
+static void tcache_validate(void);
+static void *tcache_get(int idx);
+static void tcache_put(void *bp, int idx);
+static void tcache_flush(void *bin, int n);
+static void tcache_destroy(void *arg);
+static void tcache_key_init(void);
+static void fork_prepare(void);
+static void fork_parent(void);
+static void fork_child(void);
+#endif
+
+/*
+ * The heap consistency checker is tiered.  With should_check set, every
+ * operation checks the block it touched against its neighbors and its
+ * free list links in constant time.  The whole arena is walked only once
+ * every check_period checks, where check_period is at least
+ * CHECK_PERIOD_MIN and otherwise the number of blocks the last walk found,
+ * so the walks add a constant cost per operation.
+ */
+#define CHECK_PERIOD_MIN  64
 
 /* Function prototypes for heap consistency checker routines: */
-static bool checkblock(void *bp);
-static void checkheap(bool verbose);
+static void checkop(struct arena *a, void *bp);
+static bool checkblock(struct arena *a, void *bp);
+static void checkheap(struct arena *a, bool verbose);
+static bool checktree(void *bp, void *lo, void *hi, bool verbose,
+    size_t *count);
 static void printblock(void *bp); 
 
+static int tune_load(void);
+
 const int should_check = 0;
 const int check_verbose = 0;
 
@@ -104,23 +453,78 @@ const int check_verbose = 0;
  */
 int
 mm_init(void) 
+{
+	int i;
+
+	if (tune_load() == -1)
+		return (-1);
+#ifdef MM_THREAD_SAFE
+	/* Every tcache filled from the previous heap is now stale. */
+	heap_epoch++;
+	pthread_once(&tcache_once, tcache_key_init);
+	narenas = MIN(MAX_ARENAS, MAX(1, sysconf(_SC_NPROCESSORS_ONLN)));
+#else
+	narenas = 1;
+#endif
+	/* The other arenas are created on first use. */
+	for (i = 0; i < MAX_ARENAS; i++) {
+		arenas[i].seg_listp = NULL;
+		memset(&arenas[i].stats, 0, sizeof(arenas[i].stats));
+	}
+
+	/*
+	 * The slab map covers all of the heap that can be reached.  Untouched
+	 * map pages cost nothing, and the map is cleared by discarding its
+	 * pages.
+	 */
+	heap_lo = mem_heap_lo();
+	if (slab_map == NULL) {
+		slab_map_size = mem_maxheapsize() / RUN_MIN + 2;
+		slab_map = mmap(NULL, slab_map_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (slab_map == MAP_FAILED) {
+			slab_map = NULL;
+			return (-1);
+		}
+	} else
+		madvise(slab_map, slab_map_size, MADV_DONTNEED);
+
+	return (arena_init(&arenas[0]));
+}
+
+/*
+ * Requires:
+ *   The arena's lock is held, or no other thread can reach the arena.
+ *
+ * Effects:
+ *   Create the arena's prologue with its empty segregated lists and give it
+ *   an initial free block of MM_CHUNK_SIZE bytes.  Returns 0 if the arena was
+ *   successfully initialized and -1 otherwise.
+ */
+static int
+arena_init(struct arena *a)
 {
 	/* Round up NUM_SEG to multiples of WSIZE for alignment. */
 	int num_seg_rounded = (NUM_SEG + (WSIZE - 1)) & ~(WSIZE - 1);
+	char *heap_listp;
+
 	/* Create the initial empty heap. */
-	if ((heap_listp = mem_sbrk((6 + num_seg_rounded) * WSIZE)) 
-	    == (void*) -1)
+	SBRK_LOCK();
+	heap_listp = mem_sbrk((6 + num_seg_rounded) * WSIZE);
+	a->end = (char *)mem_heap_hi() + 1;
+	SBRK_UNLOCK();
+	if (heap_listp == (void*) -1)
 		return (-1);
 	/* Prologue header */ 
 	PUT(heap_listp, PACK(num_seg_rounded * WSIZE + 2 * DSIZE, 1)); 
-	PUT(heap_listp + (1 * WSIZE), 0); 
+	PUT(heap_listp + (1 * WSIZE), ARENA_INDEX(a)); 
 	/* Pointers to each segmented free list. Each is a circular
 	   doubly linked list. */
 	int i;
 	for (i = 0; i < num_seg_rounded; i++) {
 		PUT(heap_listp + ((2 + i) * WSIZE), 0);
 	}
-	/* Prologue footer */
+	/* Prologue footer, which links to no earlier segment */
 	PUT(heap_listp + ((2 + num_seg_rounded) * WSIZE), 
 	    PACK(num_seg_rounded * WSIZE + 2 * DSIZE, 1));
 	PUT(heap_listp + ((3 + num_seg_rounded) * WSIZE), 0);
@@ -128,44 +532,107 @@ mm_init(void)
 	PUT(heap_listp + ((4 + num_seg_rounded) * WSIZE), PACK(0, 1));
 	PUT(heap_listp + ((5 + num_seg_rounded) * WSIZE), PACK(0, 1));
 	heap_listp += (2 * WSIZE);
+	a->seg_listp = heap_listp;
+	a->size = (6 + num_seg_rounded) * WSIZE;
+	a->grow = tune[MM_CHUNK_SIZE];
+	a->last_seg = heap_listp;
+	a->seg_map = 0;
+	for (i = 0; i < SLAB_CLASSES; i++) {
+		a->runs[i] = NULL;
+		a->run_log2[i] = RUN_MIN_LOG2;
+	}
+	a->check_ops = 0;
 
 	if (should_check)
-		checkheap(check_verbose);
+		checkheap(a, check_verbose);
 
-	/* Extend the empty heap with a free block of CHUNKSIZE bytes. */
-	if (extend_heap(CHUNKSIZE / WSIZE) == NULL)
+	/* Extend the empty heap with a free block of MM_CHUNK_SIZE bytes. */
+	if (extend_heap(a, tune[MM_CHUNK_SIZE] / WSIZE) == NULL)
 		return (-1);
 
 	return (0);
 }
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the calling thread's home arena.  A thread is assigned an arena
+ *   on its first allocation: the arena of the CPU it runs on, or the next
+ *   arena in round-robin order if the CPU cannot be determined.
+ */
+static struct arena *
+arena_get(void)
+{
+#ifdef MM_THREAD_SAFE
+	int cpu;
+
+	tcache_validate();
+	if (tcache.arena == NULL) {
+		if ((cpu = sched_getcpu()) < 0)
+			cpu = __atomic_fetch_add(&next_arena, 1,
+			    __ATOMIC_RELAXED);
+		tcache.arena = &arenas[cpu % narenas];
+	}
+	return (tcache.arena);
+#else
+	return (&arenas[0]);
+#endif
+}
+
+/*
+ * Requires:
+ *    A size of a free block.
+ * Effects:
+ *    Returns the index of the segregation class for that size.
+ */
+static int
+get_seg_index(size_t size)
+{
+	int log2 = FAST_LOG2(size);
+
+	if (log2 < SPLIT_LOG2)
+		return (log2);
+	if (log2 >= TOP_LOG2)
+		return (NUM_SEG - 1);
+	return (SPLIT_LOG2 + (log2 - SPLIT_LOG2) * SPLIT_COUNT + 
+	    (int) ((size >> (log2 - SPLIT_BITS)) & (SPLIT_COUNT - 1)));
+}
+
 /*
  * Requires:
  *    A size of a free block.
  * Effects:
  *    Returns a pointer to the segregation list for that size.
  */
-void *
-get_segregation(size_t size)
+static void *
+get_segregation(struct arena *a, size_t size)
 {
-	return heap_listp 
-		+  MIN(NUM_SEG - 1, FAST_LOG2(size)) * WSIZE;
+	return a->seg_listp + get_seg_index(size) * WSIZE;
 }
 
 /*
  * Requires:
- *    A free block bp.
+ *    A free block bp in arena a.
  * Effects:
  *    Adds this block to the segregated free list corresponding to
  *    its size.
  */
-void seg_block(void *bp)
+static void seg_block(struct arena *a, void *bp)
 {
 	if (check_verbose)
 		printf("seg_block\n");
-	uintptr_t seg_ptr = (uintptr_t) get_segregation(GET_SIZE(HDRP(bp)));
-
-	if (GET(seg_ptr) == 0) {
+	int idx = get_seg_index(GET_SIZE(HDRP(bp)));
+	uintptr_t seg_ptr = (uintptr_t) (a->seg_listp + idx * WSIZE);
+
+	if (idx == NUM_SEG - 1) {
+		/* The last class is a tree. */
+		a->seg_map |= 1UL << idx;
+		tree_insert((void*) seg_ptr, bp);
+	} else if (GET(seg_ptr) == 0) {
 		/* Create new circular segregation list and point to it. */
+		a->seg_map |= 1UL << idx;
 		PUT_NEXT_FREE(HDRP(bp), (uintptr_t) bp);
 		PUT(seg_ptr, (uintptr_t) bp);
 		PUT_PREV_FREE(FTRP(bp), (uintptr_t) bp);
@@ -182,19 +649,26 @@ void seg_block(void *bp)
 
 /*
  * Requires:
- *    A free block bp in a free list.
+ *    A free block bp in a free list of arena a.
  * Effects:
  *    Removes this block from the segregated free list corresponding to
  *    its size.
  */
-void remove_freelist(void *bp) {
+static void remove_freelist(struct arena *a, void *bp) {
 	void *prev = (void*) GET_PREV_FREE(FTRP(bp));
 	void *next = (void*) GET_NEXT_FREE(HDRP(bp));
 
-	void *seg = get_segregation(GET_SIZE(HDRP(bp)));
-	if (next == bp) {
+	int idx = get_seg_index(GET_SIZE(HDRP(bp)));
+	void *seg = a->seg_listp + idx * WSIZE;
+	if (idx == NUM_SEG - 1) {
+		/* The last class is a tree. */
+		tree_remove(seg, bp);
+		if (GET(seg) == 0)
+			a->seg_map &= ~(1UL << idx);
+	} else if (next == bp) {
 		/* Delete pointer to segregation list. */
 		PUT(seg, 0);
+		a->seg_map &= ~(1UL << idx);
 	} else {
 		/* Remove element from circular segregation list. */
 		PUT_NEXT_FREE(HDRP(prev), (uintptr_t) next);
@@ -206,6 +680,96 @@ void remove_freelist(void *bp) {
 		
 }
 
+/*
+ * Requires:
+ *    "link" is the root link of a treap, and "bp" is a free block of at
+ *    least 2^TOP_LOG2 bytes that is not in any free list.
+ * Effects:
+ *    Inserts "bp" into the treap.
+ */
+static void
+tree_insert(void *link, void *bp)
+{
+	void *node, *left, *right;
+
+	/* Descend to the link where bp's priority places it. */
+	while ((node = (void*) GET(link)) != NULL && 
+	    TREE_PRIO(node) > TREE_PRIO(bp))
+		link = TREE_LESS(bp, node) ? TREE_LEFT(node) : TREE_RIGHT(node);
+
+	/* Split the subtree hanging there into bp's two children. */
+	left = TREE_LEFT(bp);
+	right = TREE_RIGHT(bp);
+	while (node != NULL) {
+		if (TREE_LESS(node, bp)) {
+			PUT(left, (uintptr_t) node);
+			left = TREE_RIGHT(node);
+			node = (void*) GET(TREE_RIGHT(node));
+		} else {
+			PUT(right, (uintptr_t) node);
+			right = TREE_LEFT(node);
+			node = (void*) GET(TREE_LEFT(node));
+		}
+	}
+	PUT(left, 0);
+	PUT(right, 0);
+	PUT(link, (uintptr_t) bp);
+}
+
+/*
+ * Requires:
+ *    "link" is the root link of a treap that contains "bp".
+ * Effects:
+ *    Removes "bp" from the treap.
+ */
+static void
+tree_remove(void *link, void *bp)
+{
+	void *node, *left, *right;
+
+	while ((node = (void*) GET(link)) != bp)
+		link = TREE_LESS(bp, node) ? TREE_LEFT(node) : TREE_RIGHT(node);
+
+	/* Replace bp by the merge of its two subtrees. */
+	left = (void*) GET(TREE_LEFT(bp));
+	right = (void*) GET(TREE_RIGHT(bp));
+	while (left != NULL && right != NULL) {
+		if (TREE_PRIO(left) > TREE_PRIO(right)) {
+			PUT(link, (uintptr_t) left);
+			link = TREE_RIGHT(left);
+			left = (void*) GET(TREE_RIGHT(left));
+		} else {
+			PUT(link, (uintptr_t) right);
+			link = TREE_LEFT(right);
+			right = (void*) GET(TREE_LEFT(right));
+		}
+	}
+	PUT(link, (uintptr_t) (left != NULL ? left : right));
+}
+
+/*
+ * Requires:
+ *    "link" is the root link of a treap.
+ * Effects:
+ *    Returns the smallest block in the treap of at least "asize" bytes,
+ *    the lowest addressed of these if there is a tie, or NULL if there is
+ *    no such block.
+ */
+static void *
+tree_fit(void *link, size_t asize)
+{
+	void *bp, *fit = NULL;
+
+	for (bp = (void*) GET(link); bp != NULL; ) {
+		if (GET_SIZE(HDRP(bp)) >= asize) {
+			fit = bp;
+			bp = (void*) GET(TREE_LEFT(bp));
+		} else
+			bp = (void*) GET(TREE_RIGHT(bp));
+	}
+	return (fit);
+}
+
 /* 
  * Requires:
  *   None.
@@ -221,39 +785,44 @@ mm_malloc(size_t size)
 	if (check_verbose)
 		printf("mm_malloc(%d)\n", (int) size);
 
+	struct arena *a;
 	size_t asize;      /* Adjusted block size */
-	size_t extendsize; /* Amount to extend heap if no fit */
 	void *bp;
 
  	/* Ignore spurious requests. */
 	if (size == 0)
 		return (NULL);
 
-	/* Adjust block size to include overhead and alignment reqs. */
-	if (size <= WSIZE)
-		asize = 2 * DSIZE + WSIZE;
-	else
-		asize = WSIZE * ((size + 2 * DSIZE + (WSIZE - 1)) / WSIZE);
-
-	/* Search the free list for a fit. */
-	if ((bp = find_fit(asize)) != NULL) {
-		place(bp, asize);
-
-		if (should_check)
-			checkheap(check_verbose);
-
+	/* Huge requests get a mapping of their own. */
+	if (size >= tune[MM_MMAP_THRESHOLD])
+		return (map_alloc(size));
+
+	/* Small requests are packed into slab runs. */
+	if (size <= SLAB_MAX) {
+#ifdef MM_THREAD_SAFE
+		return (tcache_get(SLAB_CLASS(size)));
+#else
+		a = arena_get();
+		ARENA_LOCK(a);
+		bp = slab_alloc(a, SLAB_CLASS(size));
+		ARENA_UNLOCK(a);
 		return (bp);
+#endif
 	}
 
-	/* No fit found.  Get more memory and place the block. */
-	extendsize = MAX(asize, CHUNKSIZE);
-	if ((bp = extend_heap(extendsize / WSIZE)) == NULL)  
+	/* Adjust block size to include overhead and alignment reqs. */
+	if ((asize = adjust_size(size)) == 0)
 		return (NULL);
 
-	place(bp, asize);
-	
-	if (should_check)
-		checkheap(check_verbose);
+#ifdef MM_THREAD_SAFE
+	/* Small requests are served from this thread's cache. */
+	if (asize <= TCACHE_MAX)
+		return (tcache_get(TCACHE_IDX(asize)));
+#endif
+	a = arena_get();
+	ARENA_LOCK(a);
+	bp = heap_alloc(a, asize);
+	ARENA_UNLOCK(a);
 
 	return (bp);
 } 
@@ -270,21 +839,39 @@ mm_free(void *bp)
 {
 	if (check_verbose)
 		printf("mm_free(%p)\n", bp);
-	size_t size;
+	struct arena *a;
+	struct run *r;
 
 	/* Ignore spurious requests. */
 	if (bp == NULL)
 		return;
 
-	/* Free and coalesce the block. */
-	size = GET_SIZE(HDRP(bp));
-	PUT(HDRP(bp), PACK(size, 0));
-	PUT(FTRP(bp), PACK(size, 0));
-	
-	coalesce(bp);
-
-	if (should_check)
-		checkheap(check_verbose);
+	if ((r = slab_run(bp)) != NULL) {
+#ifdef MM_THREAD_SAFE
+		tcache_put(bp, r->cls);
+#else
+		a = GET_ARENA(r);
+		ARENA_LOCK(a);
+		slab_free(a, r, bp);
+		ARENA_UNLOCK(a);
+#endif
+		return;
+	}
+	if (IS_MAPPED(bp)) {
+		map_free(bp);
+		return;
+	}
+#ifdef MM_THREAD_SAFE
+	if (GET_SIZE(HDRP(bp)) <= TCACHE_MAX) {
+		tcache_put(bp, TCACHE_IDX(GET_SIZE(HDRP(bp))));
+		return;
+	}
+#endif
+	/* The block goes back to the arena that allocated it. */
+	a = GET_ARENA(bp);
+	ARENA_LOCK(a);
+	heap_free(a, bp);
+	ARENA_UNLOCK(a);
 }
 
 /*
@@ -305,8 +892,10 @@ mm_realloc(void *ptr, size_t size)
 {
 	if (check_verbose)
 		printf("mm_realloc\n");
-	size_t oldsize = GET_SIZE(HDRP(ptr));
-	void *newptr;
+	struct arena *a, *home;
+	struct run *r;
+	size_t asize, avail, oldsize;
+	void *bp, *newptr;
 
 	/* If size == 0 then this is just free, and we return NULL. */
 	if (size == 0) {
@@ -317,58 +906,109 @@ mm_realloc(void *ptr, size_t size)
 	/* If oldptr is NULL, then this is just malloc. */
 	if (ptr == NULL)
 		return (mm_malloc(size));
+	home = arena_get();
+	STAT_ADD(home, reallocs, 1);
+
+	/* A slab object keeps its slot if the new size fits its class. */
+	if ((r = slab_run(ptr)) != NULL) {
+		oldsize = SLAB_SIZE(r->cls);
+		if (size <= oldsize)
+			return (ptr);
+		if ((newptr = mm_malloc(size)) == NULL)
+			return (NULL);
+		STAT_ADD(home, realloc_moves, 1);
+		memcpy(newptr, ptr, oldsize);
+		mm_free(ptr);
+		return (newptr);
+	}
+
+	/* A mapped block is resized with mremap while it stays huge. */
+	if (IS_MAPPED(ptr)) {
+		if (size >= tune[MM_MMAP_THRESHOLD])
+			return (map_realloc(ptr, size));
+		if ((newptr = mm_malloc(size)) == NULL)
+			return (NULL);
+		STAT_ADD(home, realloc_moves, 1);
+		memcpy(newptr, ptr, size);
+		mm_free(ptr);
+		return (newptr);
+	}
+
+	/*
+	 * A block that is already big enough keeps its address.  Its tail is
+	 * split off and freed if that tail could be a block of its own and is
+	 * more than the MM_REALLOC_GROWTH headroom that a moved block is
+	 * given below, so that a buffer growing into its headroom keeps it.
+	 * Otherwise the arena's lock is not needed.
+	 */
+	oldsize = GET_SIZE(HDRP(ptr));
+	if ((asize = adjust_size(size)) == 0)
+		return (NULL);
+	if (asize <= oldsize) {
+		if (oldsize - asize >= tune[MM_SPLIT_MIN] &&
+		    oldsize * 100 > asize * tune[MM_REALLOC_GROWTH]) {
+			a = GET_ARENA(ptr);
+			ARENA_LOCK(a);
+			realloc_split(a, ptr, asize);
+			if (should_check)
+				checkop(a, ptr);
+			ARENA_UNLOCK(a);
+		}
+		return (ptr);
+	}
+
+	/*
+	 * Grow the block where it is if the chain of free blocks after it is
+	 * big enough, or if that chain ends the arena and the heap can be
+	 * extended by the deficit.  Otherwise, if the block before it is free
+	 * and big enough together with that chain, slide the payload back into
+	 * it.  Either way, split off whatever is left over.
+	 */
+	a = GET_ARENA(ptr);
+	ARENA_LOCK(a);
+	newptr = NULL;
+	avail = oldsize;
+	for (bp = NEXT_BLKP(ptr); !GET_ALLOC(HDRP(bp)) && avail < asize; 
+	     bp = NEXT_BLKP(bp))
+		avail += GET_SIZE(HDRP(bp));
+	if (avail < asize && bp == a->end && heap_grow(a, asize - avail))
+		avail = asize;
+	if (avail >= asize) {
+		realloc_absorb(a, ptr, bp);
+		PUT_HDR(ptr, PACK(avail, 1));
+		newptr = ptr;
+	} else if (GET_PREVFREE(HDRP(ptr)) && 
+	    GET_SIZE(HDRP(PREV_BLKP(ptr))) + avail >= asize) {
+		newptr = PREV_BLKP(ptr);
+		avail += GET_SIZE(HDRP(newptr));
+		remove_freelist(a, newptr);
+		realloc_absorb(a, ptr, bp);
+		PUT_HDR(newptr, PACK(avail, 1));
+		PUT(HDRLINK(newptr), ARENA_INDEX(a));
+		memmove(newptr, ptr, oldsize - DSIZE);
+	}
+	if (newptr != NULL) {
+		realloc_split(a, newptr, asize);
+		if (should_check)
+			checkop(a, newptr);
+	}
+	ARENA_UNLOCK(a);
+	if (newptr != NULL)
+		return (newptr);
 
-	if (size + 2 * DSIZE <= oldsize) {
-		return ptr;
-	}
-	/* If the previous block and/or next block is free and big enough
-           to allow us to just use that, use it.*/
-	void *nextblk = NEXT_BLKP(ptr);
-	void *prevblk = PREV_BLKP(ptr);
-	int nextblk_free = nextblk != NULL && !GET_ALLOC(HDRP(nextblk));
-	int prevblk_free = prevblk != NULL && !GET_ALLOC(HDRP(prevblk));
-	if (nextblk_free && 
-	    GET_SIZE(HDRP(nextblk)) + oldsize >= size + 2 * DSIZE) {
-		// Next block is big enough
-		int newsize = GET_SIZE(HDRP(nextblk)) + oldsize;
-		remove_freelist(nextblk);
-		PUT(HDRP(ptr), PACK(newsize, 1));
-		PUT(FTRP(ptr), PACK(newsize, 1));
-		return ptr;
-	} else if (prevblk_free && 
-		   GET_SIZE(HDRP(prevblk)) + oldsize >= size + 2 * DSIZE) {
-		// Previous block is big enough
-		int newsize = GET_SIZE(HDRP(prevblk)) + oldsize;
-		remove_freelist(prevblk);
-		PUT(HDRP(prevblk), PACK(newsize, 1));
-		PUT(FTRP(prevblk), PACK(newsize, 1));
-		memmove(prevblk, ptr, oldsize - DSIZE);
-		return prevblk;
-	} else if (nextblk_free && prevblk_free && 
-		   GET_SIZE(HDRP(prevblk)) + oldsize 
-		   + GET_SIZE(HDRP(nextblk)) >= size + 2 * DSIZE) {
-		// Previous + next block is big enough
-		int newsize = GET_SIZE(HDRP(prevblk)) + oldsize 
-			+ GET_SIZE(HDRP(nextblk));
-		remove_freelist(prevblk);
-		remove_freelist(nextblk);
-		PUT(HDRP(prevblk), PACK(newsize, 1));
-		PUT(FTRP(prevblk), PACK(newsize, 1));
-		memmove(prevblk, ptr, oldsize - DSIZE);
-		return prevblk;
-	}
-	/* Instead of doubling approach, 4/3 approach is more efficient 
-           in practice. */
-	size = MAX(size, 4 * oldsize / 3);
+	/* Instead of doubling approach, growing by MM_REALLOC_GROWTH percent
+           (4/3 by default) is more efficient in practice. */
+	size = MAX(size, oldsize * tune[MM_REALLOC_GROWTH] / 100);
 
 	newptr = mm_malloc(size);
 
 	/* If realloc() fails the original block is left untouched  */
 	if (newptr == NULL)
 		return (NULL);
+	STAT_ADD(home, realloc_moves, 1);
 
 	/* Copy the old data. */
-	oldsize = GET_SIZE(HDRP(ptr));
+	oldsize = GET_SIZE(HDRP(ptr)) - DSIZE;
 	if (size < oldsize)
 		oldsize = size;
 	memcpy(newptr, ptr, oldsize);
@@ -380,253 +1020,1707 @@ mm_realloc(void *ptr, size_t size)
 }
 
 
-
-/*
- * The following routines are internal helper routines.
- */
-
 /*
  * Requires:
- *   "bp" is the address of a newly freed block, not in the free list.
+ *   None.
  *
  * Effects:
- *   Perform boundary tag coalescing.  Returns the address of the coalesced
- *   block.
+ *   Return free memory to the system.  Each arena's free block at the break,
+ *   if any, is shrunk to "pad" bytes, and the whole pages inside every other
+ *   free block are released.  Returns 1 if any memory was released and 0
+ *   otherwise.
  */
-static void *
-coalesce(void *bp) 
+int
+mm_trim(size_t pad)
 {
-	if (check_verbose)
-		printf("coalesce(%p)\n", bp);
-	size_t size = GET_SIZE(HDRP(bp));
-	bool prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
-	bool next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
-
-	if (check_verbose)
-		printf("coalescing w/ size=%d prev=%d next=%d\n", 
-		       (int) size, (int) prev_alloc, (int) next_alloc);
-
-	if (prev_alloc && next_alloc) {                 /* Case 1 */
-		seg_block(bp);
-	} else if (prev_alloc && !next_alloc) {         /* Case 2 */
-		remove_freelist(NEXT_BLKP(bp));
-		size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-		PUT(HDRP(bp), PACK(size, 0));
-		PUT(FTRP(bp), PACK(size, 0));
-		seg_block(bp);
-	} else if (!prev_alloc && next_alloc) {         /* Case 3 */
-		remove_freelist(PREV_BLKP(bp));
-
-		size += GET_SIZE(HDRP(PREV_BLKP(bp)));
-		PUT(FTRP(bp), PACK(size, 0));
-		PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-		bp = PREV_BLKP(bp);
-		seg_block(bp);
-	} else {                                        /* Case 4 */
-		remove_freelist(PREV_BLKP(bp));
-		remove_freelist(NEXT_BLKP(bp));
-		size += GET_SIZE(HDRP(PREV_BLKP(bp))) + 
-			GET_SIZE(FTRP(NEXT_BLKP(bp)));
-		PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-		PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
-		bp = PREV_BLKP(bp);
-		seg_block(bp);
+	struct arena *a;
+	void *bp, *seg;
+	int i, released = 0;
+
+	for (i = 0; i < narenas; i++) {
+		a = &arenas[i];
+		ARENA_LOCK(a);
+		if (a->seg_listp == NULL) {
+			ARENA_UNLOCK(a);
+			continue;
+		}
+		if (arena_trim(a, pad) > 0)
+			released = 1;
+		for (seg = a->last_seg; seg != NULL; 
+		     seg = (void*) GET(FTRP(seg) + WSIZE)) {
+			for (bp = seg; GET_SIZE(HDRP(bp)) > 0; 
+			     bp = NEXT_BLKP(bp)) {
+				if (GET_ALLOC(HDRP(bp)) || 
+				    GET_SIZE(HDRP(bp)) < mem_pagesize())
+					continue;
+				/* Keep the free list links and the footer. */
+				mem_release((char *)bp + DSIZE, 
+				    FTRP(bp) - ((char *)bp + DSIZE));
+				released = 1;
+			}
+		}
+		ARENA_UNLOCK(a);
 	}
-	if (should_check)
-		checkheap(check_verbose);
-
-	return (bp);
+	return (released);
 }
 
-/* 
+/*
  * Requires:
- *   None.
+ *   "alignment" is a power of two.
  *
  * Effects:
- *   Extend the heap with a free block and return that block's address.
+ *   Allocate a block with at least "size" bytes of payload aligned to
+ *   "alignment" bytes, unless "size" is zero.  The block can be freed or
+ *   reallocated like any other.  Returns the address of this block if the
+ *   allocation was successful and NULL otherwise.
  */
-static void *
-extend_heap(size_t words) 
+void *
+mm_memalign(size_t alignment, size_t size)
 {
-	if (check_verbose)
-		printf("extend_heap(%d bytes)\n", (int) (words * WSIZE));
-	size_t size;
+	struct arena *a;
+	size_t asize;
 	void *bp;
 
-	/* Allocate an even number of words to maintain alignment. */
-	size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
-	if ((bp = mem_sbrk(size)) == (void *)-1)  
+	/* Every payload is already this well aligned. */
+	if (alignment <= MM_ALIGNMENT)
+		return (mm_malloc(size));
+	if (size == 0 || size > SIZE_MAX / 4 || alignment > SIZE_MAX / 4)
 		return (NULL);
 
-	/* Initialize free block header/footer and the epilogue header. */
-	PUT(HDRP(bp), PACK(size, 0));         /* Free block header */
-	PUT(FTRP(bp), PACK(size, 0));         /* Free block footer */
-	PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* New epilogue header */
-	PUT(HDRP(NEXT_BLKP(bp)) + WSIZE, PACK(0, 1)); /* New epilogue header */
-
-	/* Better in practice not to coalesce. */
-	seg_block(bp);
-	//bp = coalesce(bp);
-
-        if (should_check)
-		checkheap(check_verbose);
-
-	return bp;
+	asize = adjust_size(size);
+	a = arena_get();
+	ARENA_LOCK(a);
+	bp = heap_alloc_aligned(a, asize, alignment);
+	ARENA_UNLOCK(a);
+	return (bp);
 }
 
 /*
  * Requires:
- *   None.
+ *   "ptr" is the address of an allocated block.
  *
  * Effects:
- *   Find a fit for a block with "asize" bytes.  Returns that block's address
- *   or NULL if no suitable block was found.
+ *   Returns the number of payload bytes of the block "ptr", which may be
+ *   more than were requested.
  */
-static void *
-find_fit(size_t asize)
+size_t
+mm_usable_size(void *ptr)
 {
-	if (check_verbose)
-		printf("find_fit\n");
-	void *seg = get_segregation(asize);
-	
-	/* If this block is the largest segregation, search the free list. */
-	if (seg == (void*) ((NUM_SEG - 1) * WSIZE + heap_listp)) {
-		void *bp;
-		/* Search for the first fit. */
-		void *startBp = NULL;
-		for (bp = (void*) GET(seg); bp != startBp; 
-		     bp = (void*) GET_NEXT_FREE(HDRP(bp))) {
-			if (asize <= GET_SIZE(HDRP(bp))) {
-				PUT(seg, (uintptr_t) GET_NEXT_FREE(HDRP(bp)));
-				return (bp);
-			}
-			startBp = (void*) GET(seg);
-		}
-	} else {
-		/* Otherwise, we try a more efficient approach. */
-		// If there is an element in the segregation, check if it fits.
-		// However, don't iterate through all of them!
-		if (GET(seg) != 0 && asize <= GET_SIZE(HDRP(GET(seg)))) {
-			return (void*) GET(seg);
-		}
-		// Start at the NEXT segregation to improve performance.
-		if (seg < (void*) ((NUM_SEG - 1) * WSIZE + heap_listp)) {
-			seg += WSIZE;
-		}
-		void *last_seg = NUM_SEG * WSIZE + heap_listp; 
-		for (; seg < last_seg; seg += WSIZE) {
-			// We don't have to iterate because these are 
-			// all in a bigger size class, so all are big enough.
-			if (GET(seg) != 0) {
-				return (void*) GET(seg);
-			}
-		}
-	}
+	struct run *r;
 
-	/* No fit was found. */
-	return (NULL);
+	if ((r = slab_run(ptr)) != NULL)
+		return (SLAB_SIZE(r->cls));
+	return (GET_SIZE(HDRP(ptr)) - DSIZE);
 }
 
-/* 
+/*
  * Requires:
- *   "bp" is the address of a free block that is at least "asize" bytes.
+ *   "out" has room for "n" addresses.
  *
  * Effects:
- *   Place a block of "asize" bytes at the start of the free block "bp" and
- *   split that block if the remainder would be at least the minimum block
- *   size. 
+ *   Allocate "n" blocks of at least "size" bytes of payload each, storing
+ *   their addresses in "out".  Blocks are carved in bulk from as few free
+ *   blocks as possible, with one free list update for each, under a single
+ *   acquisition of the arena's lock.  Returns the number of blocks
+ *   allocated, which is less than "n" only if memory ran out, or 0 if
+ *   "size" is zero.
  */
-static void
-place(void *bp, size_t asize)
+size_t
+mm_malloc_batch(size_t size, size_t n, void **out)
 {
-	if (check_verbose)
-		printf("place(%p)\n", bp);
-	if (should_check) {
-		checkheap(check_verbose);
-	}
-	size_t csize = GET_SIZE(HDRP(bp));   
+	struct arena *a;
+	size_t asize, got, total;
+	void *bp;
 
-        remove_freelist(bp);
+	if (size == 0)
+		return (0);
 
-	// If we can seperate this into another free block
-	if ((csize - asize) >= (2 * DSIZE + WSIZE)) { 
-		PUT(HDRP(bp), PACK(asize, 1));
-		PUT(HDRLINK(bp), 0);
-		PUT(FTRP(bp), PACK(asize, 1));
-		// Create new free block
+	/* Huge requests get a mapping of their own. */
+	if (size >= tune[MM_MMAP_THRESHOLD]) {
+		for (got = 0; got < n; got++)
+			if ((out[got] = map_alloc(size)) == NULL)
+				break;
+		return (got);
+	}
+
+	a = arena_get();
+	ARENA_LOCK(a);
+	got = 0;
+	if (size <= SLAB_MAX) {
+		for (; got < n; got++)
+			if ((out[got] = slab_alloc(a, SLAB_CLASS(size))) == NULL)
+				break;
+	} else if ((asize = adjust_size(size)) != 0 &&
+	    (a->seg_listp != NULL || arena_init(a) == 0)) {
+		/*
+		 * Prefer a free block that holds the whole rest of the batch,
+		 * then any block that holds at least one, and only then grow
+		 * the heap by the rest of the batch.  A rest too big to size
+		 * is placed a block at a time.
+		 */
+		while (got < n) {
+			if (__builtin_mul_overflow(asize, n - got, &total))
+				total = 0;
+			if ((total == 0 || (bp = find_fit(a, total)) == NULL) &&
+			    (bp = find_fit(a, asize)) == NULL &&
+			    (bp = extend_heap(a, grow_size(a,
+			    MAX(asize, total)) / WSIZE)) == NULL)
+				break;
+			got += place_batch(a, bp, asize, out + got, n - got);
+		}
+	}
+	ARENA_UNLOCK(a);
+	return (got);
+}
+
+/*
+ * Requires:
+ *   Each entry of "ptrs" is NULL or the address of a distinct allocated
+ *   block.
+ *
+ * Effects:
+ *   Free the "n" blocks of "ptrs", which is sorted by address in the
+ *   process.  Blocks of the same arena are freed under one acquisition of
+ *   its lock, and each run of blocks that are adjacent in the heap is
+ *   merged and coalesced into the segregated lists as a single block.
+ */
+void
+mm_free_batch(void **ptrs, size_t n)
+{
+	struct arena *a, *locked;
+	struct run *r;
+	size_t i, size;
+	void *bp;
+
+	sort_ptrs(ptrs, n);
+	locked = NULL;
+	for (i = 0; i < n; i++) {
+		bp = ptrs[i];
+		if (bp == NULL)
+			continue;
+		if ((r = slab_run(bp)) != NULL)
+			a = GET_ARENA(r);
+		else if (IS_MAPPED(bp)) {
+			map_free(bp);
+			continue;
+		} else
+			a = GET_ARENA(bp);
+		if (a != locked) {
+			if (locked != NULL)
+				ARENA_UNLOCK(locked);
+			ARENA_LOCK(a);
+			locked = a;
+		}
+		if (r != NULL) {
+			slab_free(a, r, bp);
+			continue;
+		}
+
+		/* Absorb the blocks that follow this one in the heap. */
+		size = GET_SIZE(HDRP(bp));
+		while (i + 1 < n && ptrs[i + 1] == (char *)bp + size &&
+		    slab_run(ptrs[i + 1]) == NULL) {
+			size += GET_SIZE(HDRP(ptrs[i + 1]));
+			i++;
+		}
+		PUT_HDR(bp, PACK(size, 1));
+		heap_free(a, bp);
+	}
+	if (locked != NULL)
+		ARENA_UNLOCK(locked);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Create an empty region in the calling thread's arena.  A region may
+ *   be used by one thread at a time.  Returns the region if it was created
+ *   and NULL otherwise.
+ */
+struct mm_region *
+mm_region_create(void)
+{
+	struct mm_region *rg;
+	struct chunk *c;
+	struct arena *a;
+
+	a = arena_get();
+	if ((c = chunk_alloc(a, REGION_CHUNK)) == NULL)
+		return (NULL);
+	c->next = NULL;
+	rg = (struct mm_region *) ((char *)c + CHUNK_HDR);
+	rg->chunks = c;
+	rg->cur = (char *)rg + REGION_ALIGN(sizeof(*rg));
+	rg->end = (char *)c + GET_SIZE(HDRP(c)) - DSIZE;
+	rg->grow = MIN(2 * REGION_CHUNK, REGION_CHUNK_MAX);
+	rg->arena = a;
+	return (rg);
+}
+
+/*
+ * Requires:
+ *   "rg" is a region that has not been destroyed.
+ *
+ * Effects:
+ *   Allocate an object of at least "size" bytes from region "rg" by
+ *   bumping the pointer of its newest chunk.  The object lives until the
+ *   region is destroyed and must not be passed to mm_free or mm_realloc.
+ *   Returns the address of the object if the allocation was successful
+ *   and NULL otherwise.
+ */
+void *
+mm_region_alloc(struct mm_region *rg, size_t size)
+{
+	void *p;
+
+	if (size == 0 || size > SIZE_MAX / 2)
+		return (NULL);
+	size = REGION_ALIGN(size);
+	if (size > (size_t) (rg->end - rg->cur))
+		return (region_grow(rg, size));
+	p = rg->cur;
+	rg->cur += size;
+	return (p);
+}
+
+/*
+ * Requires:
+ *   "rg" is a region that has not been destroyed.
+ *
+ * Effects:
+ *   Free every object of region "rg" and the region itself, returning
+ *   each chunk to the segregated lists as a single block under one
+ *   acquisition of the arena's lock.
+ */
+void
+mm_region_destroy(struct mm_region *rg)
+{
+	struct arena *a = rg->arena;
+	struct chunk *c, *next;
+	struct chunk *own = (struct chunk *) ((char *)rg - CHUNK_HDR);
+
+	/*
+	 * The region lives in the first chunk it was given, which is not
+	 * necessarily last in the list, so that chunk is freed after all the
+	 * others.
+	 */
+	ARENA_LOCK(a);
+	for (c = rg->chunks; c != NULL; c = next) {
+		next = c->next;
+		if (c == own)
+			continue;
+		if (IS_MAPPED(c))
+			map_free(c);
+		else
+			heap_free(a, c);
+	}
+	heap_free(a, own);
+	ARENA_UNLOCK(a);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Set the tunable "param", one of the MM_* parameters in mm.h, to
+ *   "value".  Sizes are rounded up to the alignment.  The new value
+ *   applies to later requests.  Returns 0 if the value was accepted and -1
+ *   if the parameter is unknown or the value is out of range.
+ */
+int
+mm_config(int param, size_t value)
+{
+	if (tune_load() == -1)
+		return (-1);
+	switch (param) {
+	case MM_CHUNK_SIZE:
+	case MM_GROW_MAX:
+	case MM_SPLIT_MIN:
+		/* Every block, and so every heap extension, is aligned. */
+		if (value < MINBLOCK || value > (size_t) 1 << 40)
+			return (-1);
+		value = (value + MM_ALIGNMENT - 1) & ~(MM_ALIGNMENT - 1);
+		break;
+	case MM_REALLOC_GROWTH:
+		if (value < 100 || value > 1000)
+			return (-1);
+		break;
+	case MM_TRIM_THRESHOLD:
+	case MM_TRIM_PAD:
+		break;
+	case MM_MMAP_THRESHOLD:
+		if (value == 0)
+			return (-1);
+		break;
+	default:
+		return (-1);
+	}
+	tune[param] = value;
+	return (0);
+}
+
+/*
+ * Requires:
+ *   "st" is not NULL.
+ *
+ * Effects:
+ *   Fill in "*st" with the state of the heap and the event counts since
+ *   mm_init.  Every arena's heap is walked under its lock.  Blocks in a
+ *   thread's cache and objects in its slab bins count as live.
+ */
+void
+mm_stats(struct mm_stats *st)
+{
+	struct arena *a;
+	struct run *r;
+	size_t largest, size, objs;
+	void *bp, *seg;
+	int i, cls;
+
+	memset(st, 0, sizeof(*st));
+	largest = 0;
+	for (i = 0; i < narenas; i++) {
+		a = &arenas[i];
+		ARENA_LOCK(a);
+		st->extends += a->stats.extends;
+		st->splits += a->stats.splits;
+		st->coalesces += a->stats.coalesces;
+		st->reallocs += a->stats.reallocs;
+		st->realloc_in_place += a->stats.reallocs - 
+		    a->stats.realloc_moves;
+		if (a->seg_listp == NULL) {
+			ARENA_UNLOCK(a);
+			continue;
+		}
+		st->heap_bytes += a->size;
+		/* Walk each segment, skipping its prologue or fence. */
+		for (seg = a->last_seg; seg != NULL; 
+		     seg = (void *) GET(FTRP(seg) + WSIZE)) {
+			for (bp = NEXT_BLKP(seg); GET_SIZE(HDRP(bp)) > 0; 
+			     bp = NEXT_BLKP(bp)) {
+				size = GET_SIZE(HDRP(bp));
+				if (!GET_ALLOC(HDRP(bp))) {
+					cls = get_seg_index(size);
+					st->class_bytes[cls] += size;
+					st->class_blocks[cls]++;
+					st->free_bytes += size;
+					st->free_blocks++;
+					largest = MAX(largest, size);
+				} else if ((r = slab_run(bp)) == bp) {
+					objs = r->nobjs - r->nfree;
+					st->live_bytes += objs * 
+					    SLAB_SIZE(r->cls);
+					st->live_blocks += objs;
+				} else {
+					st->live_bytes += size - DSIZE;
+					st->live_blocks++;
+				}
+			}
+		}
+		ARENA_UNLOCK(a);
+	}
+	st->mapped_bytes = mem_mapsize();
+	if (st->free_bytes > 0)
+		st->fragmentation = 1.0 - (double) largest / st->free_bytes;
+}
+
+/*
+ * The following routines are internal helper routines.
+ */
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   On the first call, set every tunable whose environment variable is
+ *   set.  A size may end in K, M or G, as parsed by mem_parse_size.
+ *   Returns 0 if every variable was accepted and -1 otherwise.
+ */
+static int
+tune_load(void)
+{
+	char *value;
+	size_t size;
+	int i;
+
+	if (tune_loaded)
+		return (0);
+	tune_loaded = true;
+	for (i = 0; i < MM_NPARAMS; i++) {
+		if ((value = getenv(tune_names[i])) == NULL || *value == '\0')
+			continue;
+		if (mem_parse_size(value, &size) == -1 ||
+		    mm_config(i, size) == -1) {
+			fprintf(stderr, "mm_init: bad %s \"%s\"\n",
+			    tune_names[i], value);
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of a newly freed block in arena "a", not in the
+ *   free list.
+ *
+ * Effects:
+ *   Perform boundary tag coalescing.  Returns the address of the coalesced
+ *   block.
+ */
+static void *
+coalesce(struct arena *a, void *bp) 
+{
+	if (check_verbose)
+		printf("coalesce(%p)\n", bp);
+	size_t size = GET_SIZE(HDRP(bp));
+	bool prev_alloc = !GET_PREVFREE(HDRP(bp));
+	bool next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+
+	if (check_verbose)
+		printf("coalescing w/ size=%d prev=%d next=%d\n", 
+		       (int) size, (int) prev_alloc, (int) next_alloc);
+	a->stats.coalesces += !prev_alloc + !next_alloc;
+
+	if (prev_alloc && next_alloc) {                 /* Case 1 */
+		SET_PREVFREE(NEXT_BLKP(bp));
+		seg_block(a, bp);
+	} else if (prev_alloc && !next_alloc) {         /* Case 2 */
+		remove_freelist(a, NEXT_BLKP(bp));
+		size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
+		PUT_HDR(bp, PACK(size, 0));
+		PUT(FTRP(bp), PACK(size, 0));
+		seg_block(a, bp);
+	} else if (!prev_alloc && next_alloc) {         /* Case 3 */
+		remove_freelist(a, PREV_BLKP(bp));
+
+		size += GET_SIZE(HDRP(PREV_BLKP(bp)));
+		PUT(FTRP(bp), PACK(size, 0));
+		PUT_HDR(PREV_BLKP(bp), PACK(size, 0));
+		bp = PREV_BLKP(bp);
+		SET_PREVFREE(NEXT_BLKP(bp));
+		seg_block(a, bp);
+	} else {                                        /* Case 4 */
+		remove_freelist(a, PREV_BLKP(bp));
+		remove_freelist(a, NEXT_BLKP(bp));
+		size += GET_SIZE(HDRP(PREV_BLKP(bp))) + 
+			GET_SIZE(FTRP(NEXT_BLKP(bp)));
+		PUT_HDR(PREV_BLKP(bp), PACK(size, 0));
+		PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
+		bp = PREV_BLKP(bp);
+		seg_block(a, bp);
+	}
+	if (should_check)
+		checkop(a, bp);
+
+	return (bp);
+}
+
+/* 
+ * Requires:
+ *   The arena's lock is held.
+ *
+ * Effects:
+ *   Extend arena "a" with a free block and return that block's address.
+ *   The block continues the arena's newest segment if that segment still
+ *   ends at the break, and starts a new fenced segment otherwise.
+ */
+static void *
+extend_heap(struct arena *a, size_t words) 
+{
+	if (check_verbose)
+		printf("extend_heap(%d bytes)\n", (int) (words * WSIZE));
+	size_t huge = mem_hugepagesize();
+	size_t size, overhead;
+	uintptr_t end;
+	void *bp, *fence;
+
+	/* Allocate an even number of words to maintain alignment. */
+	size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
+	fence = NULL;
+	SBRK_LOCK();
+	overhead = (a->end == (char *)mem_heap_hi() + 1) ? 0 : 3 * DSIZE;
+	if (huge != 0 && size >= huge) {
+		/* End a large extension on a huge page boundary. */
+		end = (uintptr_t) mem_heap_hi() + 1 + overhead + size;
+		size += (huge - end % huge) % huge;
+	}
+	if (overhead == 0) {
+		/* The new block's header replaces the old epilogue. */
+		bp = mem_sbrk(size);
+	} else if ((bp = mem_sbrk(size + overhead)) != (void *)-1) {
+		/* Leave room for a fence block in front of the new block. */
+		fence = (char *)bp + DSIZE;
+		bp = (char *)bp + 3 * DSIZE;
+	}
+	if (bp != (void *)-1) {
+		a->end = (char *)mem_heap_hi() + 1;
+		a->size += size + overhead;
+	}
+	SBRK_UNLOCK();
+	if (bp == (void *)-1)
+		return (NULL);
+
+	if (fence != NULL) {
+		/*
+		 * The fence's footer links the new segment to the last one.
+		 * Like the prologue, a fence keeps a footer even though it is
+		 * allocated.
+		 */
+		PUT(HDRP(fence), PACK(2 * DSIZE, 1));
+		PUT(HDRLINK(fence), ARENA_INDEX(a));
+		PUT(FTRP(fence), PACK(2 * DSIZE, 1));
+		PUT(FTRP(fence) + WSIZE, (uintptr_t) a->last_seg);
+		a->last_seg = fence;
+		PUT(HDRP(bp), PACK(size, 0));     /* Free block header */
+	} else {
+		/* The old epilogue's PREVFREE bit carries over. */
+		PUT_HDR(bp, PACK(size, 0));       /* Free block header */
+	}
+
+	/* Initialize free block footer and the epilogue header. */
+	PUT(FTRP(bp), PACK(size, 0));         /* Free block footer */
+	PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1) | PREVFREE); /* New epilogue header */
+	PUT(HDRP(NEXT_BLKP(bp)) + WSIZE, PACK(0, 1)); /* New epilogue header */
+
+	/* Better in practice not to coalesce. */
+	seg_block(a, bp);
+	a->stats.extends++;
+
+        if (should_check)
+		checkop(a, bp);
+
+	return bp;
+}
+
+/*
+ * Requires:
+ *   The arena's lock is held.
+ *
+ * Effects:
+ *   Returns the number of bytes by which to extend arena "a" to fit a
+ *   block of "asize" bytes.  Every extension doubles the next one, so an
+ *   arena that keeps growing soon does so in few large steps.  The
+ *   doubling stops at 1/GROW_FRACTION of the arena's size, bounding the
+ *   unused tail, and at MM_GROW_MAX bytes, or at one huge page when memlib
+ *   backs the heap with huge pages.
+ */
+static size_t
+grow_size(struct arena *a, size_t asize)
+{
+	size_t huge = mem_hugepagesize();
+	size_t size = MAX(asize, a->grow);
+	size_t cap;
+
+	if (huge != 0)
+		cap = huge;
+	else
+		cap = MAX(tune[MM_CHUNK_SIZE], MIN(a->size / GROW_FRACTION,
+		    tune[MM_GROW_MAX]));
+	a->grow = MIN(2 * a->grow, cap);
+	return (size);
+}
+
+/*
+ * Requires:
+ *   The arena's lock is held.
+ *
+ * Effects:
+ *   Find a fit in arena "a" for a block with "asize" bytes.  Returns that block's address
+ *   or NULL if no suitable block was found.
+ */
+static void *
+find_fit(struct arena *a, size_t asize)
+{
+	if (check_verbose)
+		printf("find_fit\n");
+	int idx = get_seg_index(asize);
+	void *seg = a->seg_listp + idx * WSIZE;
+	unsigned long above;
+	
+	/* The largest segregation is a tree: take the best fit. */
+	if (idx == NUM_SEG - 1)
+		return (tree_fit(seg, asize));
+
+	// If there is an element in the segregation, check if it fits.
+	// However, don't iterate through all of them!
+	if (GET(seg) != 0 && asize <= GET_SIZE(HDRP(GET(seg)))) {
+		return (void*) GET(seg);
+	}
+	// Every block in a bigger class fits, so take the first
+	// block of the smallest non-empty one.
+	above = a->seg_map & (~0UL << (idx + 1));
+	if (above != 0) {
+		idx = __builtin_ctzl(above);
+		seg = a->seg_listp + idx * WSIZE;
+		if (idx == NUM_SEG - 1)
+			return (tree_fit(seg, asize));
+		return (void*) GET(seg);
+	}
+
+	/* No fit was found. */
+	return (NULL);
+}
+
+/* 
+ * Requires:
+ *   "bp" is the address of a free block in arena "a" that is at least
+ *   "asize" bytes.
+ *
+ * Effects:
+ *   Place a block of "asize" bytes at the start of the free block "bp" and
+ *   split that block if the remainder would be at least the minimum block
+ *   size. 
+ */
+static void
+place(struct arena *a, void *bp, size_t asize)
+{
+	if (check_verbose)
+		printf("place(%p)\n", bp);
+	if (should_check) {
+		checkop(a, bp);
+	}
+	size_t csize = GET_SIZE(HDRP(bp));   
+
+        remove_freelist(a, bp);
+
+	// If we can seperate this into another free block
+	if ((csize - asize) >= tune[MM_SPLIT_MIN]) { 
+		a->stats.splits++;
+		PUT_HDR(bp, PACK(asize, 1));
+		PUT(HDRLINK(bp), ARENA_INDEX(a));
+		// Create new free block
 		bp = NEXT_BLKP(bp);
 		PUT(HDRP(bp), PACK(csize - asize, 0));
 		PUT(FTRP(bp), PACK(csize - asize, 0));
-		seg_block(bp);
+		seg_block(a, bp);
 	} else {
 		// otherwise just place
-		PUT(HDRP(bp), PACK(csize, 1));
-		PUT(HDRLINK(bp), 0);
-		PUT(FTRP(bp), PACK(csize, 1));
+		PUT_HDR(bp, PACK(csize, 1));
+		PUT(HDRLINK(bp), ARENA_INDEX(a));
+		CLR_PREVFREE(NEXT_BLKP(bp));
+	}
+	if (should_check)
+		checkop(a, bp);
+
+}
+
+/*
+ * Requires:
+ *   The arena's lock is held.  "bp" is the address of a free block in
+ *   arena "a" that is at least "asize" bytes.
+ *
+ * Effects:
+ *   Carve up to "n" consecutive allocated blocks of "asize" bytes from the
+ *   start of the free block "bp", storing their addresses in "out".  Any
+ *   remainder of at least MM_SPLIT_MIN bytes goes back to the segregated
+ *   lists; a smaller remainder is absorbed by the last block.
+ *   Returns the number of blocks carved.
+ */
+static size_t
+place_batch(struct arena *a, void *bp, size_t asize, void **out, size_t n)
+{
+	size_t csize = GET_SIZE(HDRP(bp));
+	size_t i;
+
+	remove_freelist(a, bp);
+	n = MIN(n, csize / asize);
+	for (i = 0; i < n; i++) {
+		size_t bsize = asize;
+
+		if (i == n - 1 && csize - n * asize < tune[MM_SPLIT_MIN])
+			bsize += csize - n * asize;
+		if (i == 0)
+			PUT_HDR(bp, PACK(bsize, 1));
+		else
+			PUT(HDRP(bp), PACK(bsize, 1));
+		PUT(HDRLINK(bp), ARENA_INDEX(a));
+		out[i] = bp;
+		bp = NEXT_BLKP(bp);
+	}
+	if (csize - n * asize >= tune[MM_SPLIT_MIN]) {
+		a->stats.splits++;
+		PUT(HDRP(bp), PACK(csize - n * asize, 0));
+		PUT(FTRP(bp), PACK(csize - n * asize, 0));
+		seg_block(a, bp);
+	} else
+		CLR_PREVFREE(bp);
+	if (should_check)
+		checkop(a, bp);
+
+	return (n);
+}
+
+/*
+ * Requires:
+ *   The arena's lock is held.  "asize" is an adjusted block size.
+ *
+ * Effects:
+ *   Allocate a block of at least "asize" bytes from the segregated lists of
+ *   arena "a", creating the arena or extending it if no fit is found.
+ *   Returns the address of this block if the allocation was successful and
+ *   NULL otherwise.
+ */
+static void *
+heap_alloc(struct arena *a, size_t asize)
+{
+	size_t extendsize; /* Amount to extend heap if no fit */
+	void *bp;
+
+	if (a->seg_listp == NULL && arena_init(a) == -1)
+		return (NULL);
+
+	/* Search the free list for a fit. */
+	if ((bp = find_fit(a, asize)) != NULL) {
+		place(a, bp, asize);
+
+		if (should_check)
+			checkop(a, bp);
+
+		return (bp);
+	}
+
+	/* No fit found.  Get more memory and place the block. */
+	extendsize = grow_size(a, asize);
+	if ((bp = extend_heap(a, extendsize / WSIZE)) == NULL)  
+		return (NULL);
+
+	place(a, bp, asize);
+	
+	if (should_check)
+		checkop(a, bp);
+
+	return (bp);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Sort the "n" addresses of "ptrs" in increasing order.  A Shell sort
+ *   with inline comparisons is several times faster than qsort on the
+ *   few dozen addresses of a typical batch, and takes a single pass over
+ *   addresses that are already in order.
+ */
+static void
+sort_ptrs(void **ptrs, size_t n)
+{
+	size_t gap, i, j;
+	void *p;
+
+	for (gap = 1; gap < n / 3; gap = 3 * gap + 1)
+		continue;
+	for (; gap > 0; gap /= 3) {
+		for (i = gap; i < n; i++) {
+			p = ptrs[i];
+			for (j = i; j >= gap && (uintptr_t)ptrs[j - gap] >
+			    (uintptr_t)p; j -= gap)
+				ptrs[j] = ptrs[j - gap];
+			ptrs[j] = p;
+		}
+	}
+}
+
+/*
+ * Requires:
+ *   "size" is a nonzero request size.
+ *
+ * Effects:
+ *   Returns the size of the block that holds a payload of "size" bytes,
+ *   including its header and alignment padding, or 0 if that size cannot
+ *   be represented.
+ */
+static size_t
+adjust_size(size_t size)
+{
+	if (size > SIZE_MAX - DSIZE - MM_ALIGNMENT)
+		return (0);
+	return (MAX(MINBLOCK, MM_ALIGNMENT *
+	    ((size + DSIZE + (MM_ALIGNMENT - 1)) / MM_ALIGNMENT)));
+}
+
+/*
+ * Requires:
+ *   The arena's lock is held.  "incr" is a multiple of MM_ALIGNMENT.
+ *
+ * Effects:
+ *   Extend arena "a" by "incr" bytes past its epilogue, which moves to the
+ *   new end, if the arena's newest segment still ends at the break and the
+ *   heap has room.  The bytes join the block that ended at the old
+ *   epilogue.  Returns true if the arena was extended and false otherwise.
+ */
+static bool
+heap_grow(struct arena *a, size_t incr)
+{
+	bool grown;
+
+	SBRK_LOCK();
+	grown = a->end == (char *)mem_heap_hi() + 1 &&
+	    mem_heapsize() + incr <= mem_maxheapsize() &&
+	    mem_sbrk(incr) != (void *)-1;
+	if (grown) {
+		a->end = (char *)mem_heap_hi() + 1;
+		a->size += incr;
+	}
+	SBRK_UNLOCK();
+	if (!grown)
+		return (false);
+	a->stats.extends++;
+	PUT(HDRP(a->end), PACK(0, 1));
+	PUT(HDRLINK(a->end), PACK(0, 1));
+	return (true);
+}
+
+/*
+ * Requires:
+ *   The arena's lock is held.  The blocks from the one after "bp" up to
+ *   but not including "end" are free.
+ *
+ * Effects:
+ *   Take those free blocks out of the segregated lists, so that "bp" can
+ *   be resized over them.
+ */
+static void
+realloc_absorb(struct arena *a, void *bp, void *end)
+{
+	for (bp = NEXT_BLKP(bp); bp != end; bp = NEXT_BLKP(bp))
+		remove_freelist(a, bp);
+}
+
+/*
+ * Requires:
+ *   The arena's lock is held.  "bp" is an allocated block in arena "a" of
+ *   at least "asize" bytes, and the PREVFREE bit of the block after it may
+ *   be stale.
+ *
+ * Effects:
+ *   Split the bytes of "bp" past "asize" off as a free block if there are
+ *   at least MM_SPLIT_MIN of them, coalescing it with the block after it,
+ *   and fix the PREVFREE bit of the block after "bp".
+ */
+static void
+realloc_split(struct arena *a, void *bp, size_t asize)
+{
+	size_t size = GET_SIZE(HDRP(bp));
+	void *tail;
+
+	if (size - asize < tune[MM_SPLIT_MIN]) {
+		CLR_PREVFREE(NEXT_BLKP(bp));
+		return;
+	}
+	a->stats.splits++;
+	PUT_HDR(bp, PACK(asize, 1));
+	tail = NEXT_BLKP(bp);
+	PUT(HDRP(tail), PACK(size - asize, 0));
+	PUT(FTRP(tail), PACK(size - asize, 0));
+	coalesce(a, tail);
+}
+
+/*
+ * Requires:
+ *   The arena's lock is held.  "bp" is the address of an allocated block
+ *   in arena "a".
+ *
+ * Effects:
+ *   Mark the block "bp" free and coalesce it into the segregated lists.
+ */
+static void
+heap_free(struct arena *a, void *bp)
+{
+	size_t size = GET_SIZE(HDRP(bp));
+
+	PUT_HDR(bp, PACK(size, 0));
+	PUT(FTRP(bp), PACK(size, 0));
+	
+	bp = coalesce(a, bp);
+
+	/*
+	 * Give a large enough free block at the break back to the system.
+	 * This is off unless MM_TRIM_THRESHOLD is set, since each trimmed
+	 * page faults again when the heap regrows; mm_trim always works.
+	 */
+	if (tune[MM_TRIM_THRESHOLD] != 0 &&
+	    GET_SIZE(HDRP(bp)) >= tune[MM_TRIM_THRESHOLD] && 
+	    GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0 &&
+	    arena_trim(a, tune[MM_TRIM_PAD]) > 0)
+		bp = NULL;
+
+	if (should_check)
+		checkop(a, bp);
+}
+
+/*
+ * Requires:
+ *   The arena's lock is held.
+ *
+ * Effects:
+ *   If arena "a" ends at the break with a free block of more than "pad"
+ *   bytes, shrink the heap so that the block keeps only "pad" bytes, or
+ *   remove the block entirely if "pad" is too small to leave a block.
+ *   Returns the number of bytes returned to the system.
+ */
+static size_t
+arena_trim(struct arena *a, size_t pad)
+{
+	char *bp;
+	size_t size, keep;
+
+	if (!GET_PREVFREE(HDRP(a->end)))
+		return (0);
+	bp = PREV_BLKP(a->end);
+	size = GET_SIZE(HDRP(bp));
+	keep = (pad + DSIZE - 1) & ~(DSIZE - 1);
+	if (keep > 0 && keep < MINBLOCK)
+		keep = (MINBLOCK + DSIZE - 1) & ~(DSIZE - 1);
+	if (keep >= size)
+		return (0);
+
+	SBRK_LOCK();
+	if (a->end != (char *)mem_heap_hi() + 1) {
+		/* Another arena has grown past this one. */
+		SBRK_UNLOCK();
+		return (0);
+	}
+	remove_freelist(a, bp);
+	mem_sbrk(-(intptr_t) (size - keep));
+	a->end = (char *)mem_heap_hi() + 1;
+	SBRK_UNLOCK();
+	a->size -= size - keep;
+	/* The arena is shrinking, so start growing it slowly again. */
+	a->grow = tune[MM_CHUNK_SIZE];
+
+	if (keep > 0) {
+		PUT_HDR(bp, PACK(keep, 0));
+		PUT(FTRP(bp), PACK(keep, 0));
+		seg_block(a, bp);
+		/* New epilogue header */
+		PUT(HDRP(a->end), PACK(0, 1) | PREVFREE);
+	} else {
+		/* The epilogue replaces bp and inherits its PREVFREE bit. */
+		PUT_HDR(a->end, PACK(0, 1));
+	}
+	PUT(HDRLINK(a->end), PACK(0, 1));
+	return (size - keep);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Allocate a block with at least "size" bytes of payload in a mapping of
+ *   its own.  Returns the address of this block if the allocation was
+ *   successful and NULL otherwise.
+ */
+static void *
+map_alloc(size_t size)
+{
+	size_t pagesize = mem_pagesize();
+	size_t len;
+	char *m;
+
+	/* Rounding a size this close to SIZE_MAX would wrap. */
+	if (size > SIZE_MAX - DSIZE - pagesize)
+		return (NULL);
+	len = (size + DSIZE + pagesize - 1) & ~(pagesize - 1);
+	SBRK_LOCK();
+	m = mem_map(len);
+	SBRK_UNLOCK();
+	if (m == NULL)
+		return (NULL);
+	PUT(m, PACK(len, 1));
+	PUT(m + WSIZE, MAPPED_ARENA);
+	return (m + DSIZE);
+}
+
+/*
+ * Requires:
+ *   "bp" is a block allocated by map_alloc.
+ *
+ * Effects:
+ *   Unmap the block "bp".
+ */
+static void
+map_free(void *bp)
+{
+	SBRK_LOCK();
+	mem_unmap(HDRP(bp), GET_SIZE(HDRP(bp)));
+	SBRK_UNLOCK();
+}
+
+/*
+ * Requires:
+ *   "bp" is a block allocated by map_alloc.
+ *
+ * Effects:
+ *   Resize the mapping of block "bp" to hold at least "size" bytes of
+ *   payload, moving it if the kernel cannot grow it in place.  Returns the
+ *   address of the block if the resize was successful and NULL otherwise,
+ *   in which case "bp" is left untouched.
+ */
+static void *
+map_realloc(void *bp, size_t size)
+{
+	size_t pagesize = mem_pagesize();
+	size_t oldlen = GET_SIZE(HDRP(bp));
+	size_t len;
+	char *m;
+
+	if (size > SIZE_MAX - DSIZE - pagesize)
+		return (NULL);
+	len = (size + DSIZE + pagesize - 1) & ~(pagesize - 1);
+	if (len == oldlen)
+		return (bp);
+	SBRK_LOCK();
+	m = mem_remap(HDRP(bp), oldlen, len);
+	SBRK_UNLOCK();
+	if (m == NULL)
+		return (NULL);
+	PUT(m, PACK(len, 1));
+	return (m + DSIZE);
+}
+
+/*
+ * Requires:
+ *   The arena's lock is held.  "asize" is an adjusted block size and
+ *   "align" is a power of two.
+ *
+ * Effects:
+ *   Allocate a block of at least "asize" bytes whose payload is aligned to
+ *   "align" bytes.  The first fit for "asize" itself is used if it can hold
+ *   the aligned block, so a request is padded for the worst-case slack
+ *   only when that fit cannot.  The slack in front of the aligned payload
+ *   is split off as a free block.  Returns the address of this block if
+ *   the allocation was successful and NULL otherwise.
+ */
+static void *
+heap_alloc_aligned(struct arena *a, size_t asize, size_t align)
+{
+	size_t csize, lead;
+	size_t search = asize + align + MINBLOCK;
+	char *bp, *abp;
+
+	if (a->seg_listp == NULL && arena_init(a) == -1)
+		return (NULL);
+	if (((bp = find_fit(a, asize)) == NULL ||
+	    aligned_lead(bp, align) + asize > GET_SIZE(HDRP(bp))) &&
+	    (bp = find_fit(a, search)) == NULL &&
+	    (bp = extend_heap(a, grow_size(a, search) / WSIZE)) == NULL)
+		return (NULL);
+
+	abp = bp;
+	if ((lead = aligned_lead(bp, align)) != 0) {
+		abp = bp + lead;
+		csize = GET_SIZE(HDRP(bp));
+		a->stats.splits++;
+		remove_freelist(a, bp);
+		PUT_HDR(bp, PACK(lead, 0));
+		PUT(FTRP(bp), PACK(lead, 0));
+		seg_block(a, bp);
+		PUT(HDRP(abp), PACK(csize - lead, 0) | PREVFREE);
+		PUT(FTRP(abp), PACK(csize - lead, 0));
+		seg_block(a, abp);
+	}
+	place(a, abp, asize);
+
+	return (abp);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of a free block and "align" is a power of two.
+ *
+ * Effects:
+ *   Returns the number of bytes between "bp" and the first payload address
+ *   in it that is aligned to "align" and leaves either no slack or enough
+ *   slack to be a free block.
+ */
+static size_t
+aligned_lead(void *bp, size_t align)
+{
+	size_t lead = -(uintptr_t) bp & (align - 1);
+
+	if (lead != 0 && lead < MINBLOCK)
+		lead += (MINBLOCK - lead + align - 1) & ~(align - 1);
+	return (lead);
+}
+
+/*
+ * The following routines manage the slab runs.
+ */
+
+/*
+ * Requires:
+ *   "bp" is the address of an allocated block or slab object.
+ *
+ * Effects:
+ *   Returns the run holding "bp" if it is a slab object and NULL otherwise.
+ */
+static struct run *
+slab_run(void *bp)
+{
+	size_t page = SLAB_PAGE(bp);
+
+	/* Mapped blocks lie outside the heap and so outside slab_map. */
+	if (page >= slab_map_size || slab_map[page] == 0)
+		return (NULL);
+	return ((struct run *) ((uintptr_t) bp &
+	    ~(((uintptr_t) 1 << slab_map[page]) - 1)));
+}
+
+/*
+ * Requires:
+ *   The arena's lock is held.  "cls" is a slab size class.
+ *
+ * Effects:
+ *   Allocate an object of size class "cls" from arena "a", creating a new
+ *   run if no run of that class has a free object.  Returns the address of
+ *   the object if the allocation was successful and NULL otherwise.
+ */
+static void *
+slab_alloc(struct arena *a, int cls)
+{
+	struct run *r;
+	void *obj;
+
+	if ((r = a->runs[cls]) == NULL && (r = run_create(a, cls)) == NULL)
+		return (NULL);
+	obj = r->free;
+	r->free = *(void **)obj;
+	if (--r->nfree == 0) {
+		/* A full run leaves the list until an object is freed. */
+		a->runs[cls] = r->next;
+		if (r->next != NULL)
+			r->next->prev = NULL;
 	}
-	if (should_check)
-		checkheap(check_verbose);
+	return (obj);
+}
+
+/*
+ * Requires:
+ *   The arena's lock is held.  "obj" is an allocated object of run "r" in
+ *   arena "a".
+ *
+ * Effects:
+ *   Free the object "obj".  A run that becomes empty is returned to the
+ *   arena unless it is the only run of its class with free objects.
+ */
+static void
+slab_free(struct arena *a, struct run *r, void *obj)
+{
+	*(void **)obj = r->free;
+	r->free = obj;
+	if (r->nfree++ == 0) {
+		r->prev = NULL;
+		r->next = a->runs[r->cls];
+		if (r->next != NULL)
+			r->next->prev = r;
+		a->runs[r->cls] = r;
+	}
+	if (r->nfree == r->nobjs && (r->prev != NULL || r->next != NULL)) {
+		if (r->prev != NULL)
+			r->prev->next = r->next;
+		else
+			a->runs[r->cls] = r->next;
+		if (r->next != NULL)
+			r->next->prev = r->prev;
+		run_destroy(a, r);
+	}
+}
+
+/*
+ * Requires:
+ *   The arena's lock is held.  "cls" is a slab size class with no run that
+ *   has free objects.
+ *
+ * Effects:
+ *   Create a run of size class "cls" from a block aligned to its size, and
+ *   make it the arena's only run of that class.  Each run of a class is
+ *   twice the size of the one before, up to RUN_MAX.  Returns the run if it
+ *   was created and NULL otherwise.
+ */
+static struct run *
+run_create(struct arena *a, int cls)
+{
+	struct run *r;
+	int shift = a->run_log2[cls];
+	size_t osize = SLAB_SIZE(cls);
+	size_t size = (size_t) 1 << shift;
+	char *obj;
+	int i;
+
+	if ((r = heap_alloc_aligned(a, size + DSIZE, size)) == NULL)
+		return (NULL);
+	if (shift < RUN_MAX_LOG2)
+		a->run_log2[cls]++;
+	r->cls = cls;
+	r->nobjs = (size - RUN_HDR) / osize;
+	r->nfree = r->nobjs;
+	r->next = NULL;
+	r->prev = NULL;
+
+	/* Thread every object onto the free list, lowest address first. */
+	obj = (char *)r + RUN_HDR;
+	r->free = obj;
+	for (i = 0; i < r->nobjs - 1; i++, obj += osize)
+		*(void **)obj = obj + osize;
+	*(void **)obj = NULL;
+
+	memset(&slab_map[SLAB_PAGE(r)], shift, size / RUN_MIN);
+	a->runs[cls] = r;
+	return (r);
+}
+
+/*
+ * Requires:
+ *   The arena's lock is held.  "r" is an empty run of arena "a" that is in
+ *   no run list.
+ *
+ * Effects:
+ *   Return the run's block to the arena's segregated lists.
+ */
+static void
+run_destroy(struct arena *a, struct run *r)
+{
+	size_t page = SLAB_PAGE(r);
+
+	memset(&slab_map[page], 0, ((size_t) 1 << slab_map[page]) / RUN_MIN);
+	heap_free(a, r);
+}
+
+/*
+ * Requires:
+ *   The arena's lock is not held.
+ *
+ * Effects:
+ *   Allocate a region chunk with at least "size" bytes after its header
+ *   from the heap of arena "a".  Returns the chunk if the allocation was
+ *   successful and NULL otherwise.
+ */
+static struct chunk *
+chunk_alloc(struct arena *a, size_t size)
+{
+	struct chunk *c;
+
+	ARENA_LOCK(a);
+	c = heap_alloc(a, adjust_size(size + CHUNK_HDR));
+	ARENA_UNLOCK(a);
+	return (c);
+}
+
+/*
+ * Requires:
+ *   "size" is an aligned object size that does not fit in the rest of the
+ *   bump chunk of region "rg".
+ *
+ * Effects:
+ *   Allocate an object of "size" bytes from a new chunk of region "rg".  A
+ *   large object gets a chunk of its own, placed behind the bump chunk,
+ *   and a huge one gets its chunk from a mapping;
+ *   otherwise the new chunk becomes the bump chunk.  Returns the address
+ *   of the object if the allocation was successful and NULL otherwise.
+ */
+static void *
+region_grow(struct mm_region *rg, size_t size)
+{
+	struct chunk *c;
+
+	if (size > rg->grow / 4) {
+		/* Huge objects get a mapping of their own. */
+		if (size + CHUNK_HDR >= tune[MM_MMAP_THRESHOLD])
+			c = map_alloc(size + CHUNK_HDR);
+		else
+			c = chunk_alloc(rg->arena, size);
+		if (c == NULL)
+			return (NULL);
+		c->next = rg->chunks->next;
+		rg->chunks->next = c;
+		return ((char *)c + CHUNK_HDR);
+	}
+	if ((c = chunk_alloc(rg->arena, rg->grow)) == NULL)
+		return (NULL);
+	c->next = rg->chunks;
+	rg->chunks = c;
+	rg->cur = (char *)c + CHUNK_HDR + size;
+	rg->end = (char *)c + GET_SIZE(HDRP(c)) - DSIZE;
+	rg->grow = MIN(2 * rg->grow, REGION_CHUNK_MAX);
+	return ((char *)c + CHUNK_HDR);
+}
+
+#ifdef MM_THREAD_SAFE
+/*
+ * The following routines manage the per-thread block caches.
+ */
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Empty this thread's cache if it was filled from an earlier heap, and
+ *   register it for flushing when the thread exits.
+ */
+static void
+tcache_validate(void)
+{
+	if (tcache.epoch == heap_epoch)
+		return;
+	memset(&tcache, 0, sizeof(tcache));
+	tcache.epoch = heap_epoch;
+	pthread_setspecific(tcache_key, &tcache);
+}
+
+/*
+ * Requires:
+ *   "idx" is a tcache bin: a slab size class, or TCACHE_IDX of an adjusted
+ *   block size of at most TCACHE_MAX bytes.
+ *
+ * Effects:
+ *   Allocate an object for bin "idx" from this thread's cache.  An empty
+ *   bin is refilled with up to TCACHE_BATCH objects under one acquisition
+ *   of the home arena's lock; blocks are carved from a single free block.
+ *   Returns the address of the object if the allocation was successful and
+ *   NULL otherwise.
+ */
+static void *
+tcache_get(int idx)
+{
+	size_t asize = MINBLOCK + (size_t) (idx - SLAB_CLASSES) * WSIZE;
+	void *batch[TCACHE_BATCH];
+	struct arena *a;
+	void *bp;
+	size_t i, n;
+
+	a = arena_get();
+	if (tcache.counts[idx] > 0) {
+		bp = tcache.bins[idx];
+		tcache.bins[idx] = *(void **)bp;
+		tcache.counts[idx]--;
+		return (bp);
+	}
+
+	ARENA_LOCK(a);
+	if (idx < SLAB_CLASSES) {
+		for (n = 0; n < TCACHE_BATCH; n++)
+			if ((batch[n] = slab_alloc(a, idx)) == NULL)
+				break;
+		ARENA_UNLOCK(a);
+		if (n == 0)
+			return (NULL);
+		for (i = 0; i < n - 1; i++)
+			tcache_put(batch[i], idx);
+		return (batch[n - 1]);
+	}
+	if (a->seg_listp == NULL && arena_init(a) == -1)
+		bp = NULL;
+	else if ((bp = find_fit(a, asize * TCACHE_BATCH)) == NULL)
+		bp = extend_heap(a,
+		    grow_size(a, asize * TCACHE_BATCH) / WSIZE);
+	if (bp == NULL) {
+		/* Too little memory for a batch; try for a single block. */
+		bp = heap_alloc(a, asize);
+		ARENA_UNLOCK(a);
+		return (bp);
+	}
+	n = place_batch(a, bp, asize, batch, TCACHE_BATCH);
+	ARENA_UNLOCK(a);
+
+	/* Keep all but the last block, which may have absorbed a remainder. */
+	for (i = 0; i < n - 1; i++)
+		tcache_put(batch[i], idx);
+	return (batch[n - 1]);
+}
+
+/*
+ * Requires:
+ *   "bp" is an allocated object that belongs in tcache bin "idx".
+ *
+ * Effects:
+ *   Cache the object "bp" in this thread's cache.  A full bin first returns
+ *   TCACHE_BATCH of its objects to their arenas.
+ */
+static void
+tcache_put(void *bp, int idx)
+{
+	void *flush, *p;
+	int i;
+
+	tcache_validate();
+	if (tcache.counts[idx] >= TCACHE_FILL) {
+		/* Detach the first TCACHE_BATCH objects and free them. */
+		flush = tcache.bins[idx];
+		p = flush;
+		for (i = 1; i < TCACHE_BATCH; i++)
+			p = *(void **)p;
+		tcache.bins[idx] = *(void **)p;
+		tcache.counts[idx] -= TCACHE_BATCH;
+		tcache_flush(flush, TCACHE_BATCH);
+	}
+	*(void **)bp = tcache.bins[idx];
+	tcache.bins[idx] = bp;
+	tcache.counts[idx]++;
+}
+
+/*
+ * Requires:
+ *   "bin" is a list of at least "n" cached objects.
+ *
+ * Effects:
+ *   Free the first "n" objects of "bin", each to the arena that owns it.
+ *   Runs of objects from the same arena are freed under one acquisition of
+ *   that arena's lock.
+ */
+static void
+tcache_flush(void *bin, int n)
+{
+	struct arena *a, *locked;
+	struct run *r;
+	void *next;
+
+	locked = NULL;
+	for (; n > 0; n--) {
+		next = *(void **)bin;
+		r = slab_run(bin);
+		a = (r != NULL) ? GET_ARENA(r) : GET_ARENA(bin);
+		if (a != locked) {
+			if (locked != NULL)
+				ARENA_UNLOCK(locked);
+			ARENA_LOCK(a);
+			locked = a;
+		}
+		if (r != NULL)
+			slab_free(a, r, bin);
+		else
+			heap_free(a, bin);
+		bin = next;
+	}
+	if (locked != NULL)
+		ARENA_UNLOCK(locked);
+}
+
+/*
+ * Requires:
+ *   "arg" is the exiting thread's cache.
+ *
+ * Effects:
+ *   Return every block in the cache to the heap, unless the cache belongs
+ *   to an earlier heap.
+ */
+static void
+tcache_destroy(void *arg)
+{
+	struct tcache *tc = arg;
+	int i;
+
+	if (tc->epoch != heap_epoch)
+		return;
+	for (i = 0; i < TCACHE_BINS; i++) {
+		if (tc->counts[i] > 0)
+			tcache_flush(tc->bins[i], tc->counts[i]);
+		tc->bins[i] = NULL;
+		tc->counts[i] = 0;
+	}
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Create the key whose destructor flushes a thread's cache at exit.
+ */
+static void
+tcache_key_init(void)
+{
+	pthread_key_create(&tcache_key, tcache_destroy);
+	pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Take every lock before a fork so that the child does not inherit a
+ *   heap that another thread was in the middle of changing.
+ */
+static void
+fork_prepare(void)
+{
+	int i;
+
+	for (i = 0; i < MAX_ARENAS; i++)
+		ARENA_LOCK(&arenas[i]);
+	SBRK_LOCK();
+}
+
+/*
+ * Requires:
+ *   The locks were taken by fork_prepare.
+ *
+ * Effects:
+ *   Release every lock after a fork, in the parent.
+ */
+static void
+fork_parent(void)
+{
+	int i;
 
+	SBRK_UNLOCK();
+	for (i = 0; i < MAX_ARENAS; i++)
+		ARENA_UNLOCK(&arenas[i]);
 }
 
+/*
+ * Requires:
+ *   The locks were taken by fork_prepare.
+ *
+ * Effects:
+ *   Reset every lock after a fork, in the child, where only the forking
+ *   thread survives.  The caches of the other threads are lost, and their
+ *   blocks stay allocated.
+ */
+static void
+fork_child(void)
+{
+	int i;
+
+	pthread_mutex_init(&sbrk_lock, NULL);
+	for (i = 0; i < MAX_ARENAS; i++)
+		pthread_mutex_init(&arenas[i].lock, NULL);
+}
+#endif
+
 /* 
  * The remaining routines are heap consistency checker routines. 
  */
 
 /*
  * Requires:
- *   "bp" is the address of a block.
+ *   The arena's lock is held.  "bp" is NULL or the address of a block in
+ *   arena "a" that the current operation touched.
+ *
+ * Effects:
+ *   Check the block "bp" and, once every check_period calls, the whole of
+ *   arena "a".  Exits if an error is found.
+ */
+static void
+checkop(struct arena *a, void *bp)
+{
+	if (bp != NULL && checkblock(a, bp))
+		exit(1);
+	if (++a->check_ops >= a->check_period)
+		checkheap(a, check_verbose);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of a block in arena "a".
  *
  * Effects:
- *   Perform a minimal check on the block "bp".
+ *   Check the block "bp" against its neighbors and, if it is free, its
+ *   free list links, in constant time.  Returns true if an error was found.
  */
 static bool
-checkblock(void *bp) 
+checkblock(struct arena *a, void *bp) 
 {
 	bool was_error = false;
-	if (!GET_ALLOC(HDRP(bp))) {
-		int found = 0;
-		void *startP = NULL;
-		void* p = (void*) GET(get_segregation(GET_SIZE(HDRP(bp))));
-		while (p != startP) {
-			if (p == bp) {
-				found = 1;
-				break;
-			}
-			p = (void*) GET_NEXT_FREE(HDRP(p));
-			startP = (void*) 
-				GET(get_segregation(GET_SIZE(HDRP(bp))));
-		}
-		if (!found) {
-			printf("Error: Free bp %p is not in free list\n", bp);
-			was_error = true;
-		}
+	size_t size = GET_SIZE(HDRP(bp));
+	void *next, *prev, *child;
+	int i;
 
+	/* The epilogue has nothing to check but its own header. */
+	if (size == 0)
+		return (false);
+	if (GET_ALLOC(HDRP(bp)) && GET(HDRLINK(bp)) != ARENA_INDEX(a)) {
+		printf("Error: %p is in arena %d but marked arena %d\n", bp,
+		       (int) ARENA_INDEX(a), (int) GET(HDRLINK(bp)));
+		was_error = true;
+	}
+	if ((uintptr_t) bp % MM_ALIGNMENT) {
+		printf("Error: %p is not aligned\n", bp);
+		was_error = true;
 	}
-	if ((uintptr_t) bp % WSIZE) {
-		printf("Error: %p is not word aligned\n", bp);
+	if (size < MINBLOCK || size % MM_ALIGNMENT != 0) {
+		printf("Error: %p has a bad size %zu\n", bp, size);
 		was_error = true;
+		return (was_error);
 	}
-	if (GET(HDRP(bp)) != GET(FTRP(bp))) {
+	if (!GET_ALLOC(HDRP(bp)) && 
+	    (GET(HDRP(bp)) & ~PREVFREE) != GET(FTRP(bp))) {
 		printf("Error: header does not match footer, was %d != %d\n",
 		       (int) GET(HDRP(bp)), (int) GET(FTRP(bp)));
 		was_error = true;
 	}
-	return was_error;
+
+	/* The boundary tags on either side must agree with this block's. */
+	if (!GET_PREVFREE(HDRP(NEXT_BLKP(bp))) != !!GET_ALLOC(HDRP(bp))) {
+		printf("Error: %p has a wrong PREVFREE bit\n", NEXT_BLKP(bp));
+		was_error = true;
+	}
+	if (GET_PREVFREE(HDRP(bp))) {
+		prev = PREV_BLKP(bp);
+		if (GET_ALLOC(HDRP(prev)) || NEXT_BLKP(prev) != bp) {
+			printf("Error: %p has a bad free block before it\n",
+			       bp);
+			was_error = true;
+		}
+	}
+	if (GET_ALLOC(HDRP(bp)))
+		return (was_error);
+
+	/* A free block must be linked into the right class. */
+	if (!((a->seg_map >> get_seg_index(size)) & 1)) {
+		printf("Error: free bp %p is in an empty class\n", bp);
+		was_error = true;
+	}
+	if (get_seg_index(size) == NUM_SEG - 1) {
+		for (i = 0; i < 2; i++) {
+			child = (void*) GET(i == 0 ? TREE_LEFT(bp) : 
+			    TREE_RIGHT(bp));
+			if (child == NULL)
+				continue;
+			if (TREE_PRIO(child) > TREE_PRIO(bp) || 
+			    TREE_LESS(child, bp) != (i == 0)) {
+				printf("Error: %p is misplaced under %p in "
+				       "free tree\n", child, bp);
+				was_error = true;
+			}
+		}
+	} else {
+		next = (void*) GET_NEXT_FREE(HDRP(bp));
+		prev = (void*) GET_PREV_FREE(FTRP(bp));
+		if (next == NULL || prev == NULL || 
+		    (void*) GET_PREV_FREE(FTRP(next)) != bp ||
+		    (void*) GET_NEXT_FREE(HDRP(prev)) != bp) {
+			printf("Error: free bp %p has bad list links\n", bp);
+			was_error = true;
+		}
+	}
+	return (was_error);
 }
 
 /* 
  * Requires:
- *   None.
+ *   The arena's lock is held.
  *
  * Effects:
- *   Perform a minimal check of the heap for consistency. 
+ *   Check all of arena "a" for consistency in time linear in its number of
+ *   blocks, and set the arena's check period from that number.  Exits if
+ *   an error is found.
  */
-void
-checkheap(bool verbose) 
+static void
+checkheap(struct arena *a, bool verbose) 
 {
-	void *bp;
+	char *heap_listp = a->seg_listp;
+	void *bp, *seg;
 	int was_error = false;
+	size_t nblocks = 0, nfree = 0, nlisted = 0;
 
 	if (verbose)
 		printf("Heap (%p):\n", heap_listp);
@@ -635,18 +2729,26 @@ checkheap(bool verbose)
 		was_error = true;
 		printf("Bad prologue header: Was unallocated\n");
 	}
-	checkblock(heap_listp);
-	for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+	checkblock(a, heap_listp);
+	/* Walk each segment, from its prologue or fence to its epilogue. */
+	for (seg = a->last_seg; seg != NULL; 
+	     seg = (void*) GET(FTRP(seg) + WSIZE)) {
+		for (bp = seg; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+			if (verbose)
+				printblock(bp);
+			was_error |= checkblock(a, bp);
+			nblocks++;
+			if (!GET_ALLOC(HDRP(bp)))
+				nfree++;
+		}
+
 		if (verbose)
 			printblock(bp);
-		was_error |= checkblock(bp);
-	}
-
-	if (verbose)
-		printblock(bp);
-	if (GET_SIZE(HDRP(bp)) != 0 || !GET_ALLOC(HDRP(bp))) {
-		printf("Bad epilogue header, was %d\n", (int) GET(HDRP(bp)));
-		was_error = true;
+		if (GET_SIZE(HDRP(bp)) != 0 || !GET_ALLOC(HDRP(bp))) {
+			printf("Bad epilogue header, was %d\n", 
+			       (int) GET(HDRP(bp)));
+			was_error = true;
+		}
 	}
 
 	int i;
@@ -654,12 +2756,22 @@ checkheap(bool verbose)
 		if (verbose)
 			printf("Free list %d:\n", i);
 		void* p = (void*) GET(heap_listp + i * WSIZE);
-		if (p != NULL) {
+		if ((p != NULL) != ((a->seg_map >> i) & 1)) {
+			printf("Free list %d is %s but its bitmap bit is %s\n",
+			       i, p != NULL ? "non-empty" : "empty",
+			       (a->seg_map >> i) & 1 ? "set" : "clear");
+			was_error = true;
+		}
+		if (i == NUM_SEG - 1) {
+			was_error |= checktree(p, NULL, NULL, verbose,
+			    &nlisted);
+		} else if (p != NULL) {
 			int isStart = 1;
 			void* startP = p;
 			void *prevP = NULL;
 			while (isStart || p != startP) {
 				isStart = 0;
+				nlisted++;
 				if (verbose) 
 					printblock(p);
 				size_t size = GET_SIZE(HDRP(p));
@@ -681,13 +2793,13 @@ checkheap(bool verbose)
 					       GET_NEXT_FREE(HDRP(prevP)));
 					was_error = true;
 				}
-				if (get_segregation(size) != 
+				if (get_segregation(a, size) != 
 				    heap_listp + i * WSIZE) {
 					printf("Block %p was in free list %d",
 					       p, i); 
 					printf(" but size=%d. Should be %d\n", 
 					      (int) size, (int) 
-					       (((char*) get_segregation(size) 
+					       (((char*) get_segregation(a, size) 
 						 - heap_listp) / WSIZE));
 					was_error = true;
 				}
@@ -702,8 +2814,71 @@ checkheap(bool verbose)
 			}
 		}
 	}
+
+	/*
+	 * Every listed block was found to be free, so if there are as many
+	 * listed blocks as free blocks, then every free block is listed.
+	 */
+	if (nlisted != nfree) {
+		printf("Error: %zu free blocks but %zu in free lists\n",
+		       nfree, nlisted);
+		was_error = true;
+	}
 	if (was_error)
 		exit(1);
+	a->check_ops = 0;
+	a->check_period = MAX(CHECK_PERIOD_MIN, nblocks);
+}
+
+/*
+ * Requires:
+ *   "bp" is NULL or a block in a free treap, in the subtree
+ *   bounded below by "lo" and above by "hi" (either may be NULL).
+ *
+ * Effects:
+ *   Check the order, priorities and blocks of the subtree rooted at "bp",
+ *   and add its number of blocks to "*count".  Returns true if an error
+ *   was found.
+ */
+static bool
+checktree(void *bp, void *lo, void *hi, bool verbose, size_t *count)
+{
+	bool was_error = false;
+	void *child;
+	int i;
+
+	if (bp == NULL)
+		return (false);
+	(*count)++;
+	if (verbose)
+		printblock(bp);
+	if (GET_ALLOC(HDRP(bp))) {
+		printf("Block %p was in free tree but was not free.\n", bp);
+		was_error = true;
+	}
+	if (get_seg_index(GET_SIZE(HDRP(bp))) != NUM_SEG - 1) {
+		printf("Block %p was in free tree but size=%d\n", bp,
+		       (int) GET_SIZE(HDRP(bp)));
+		was_error = true;
+	}
+	if ((lo != NULL && !TREE_LESS(lo, bp)) || 
+	    (hi != NULL && !TREE_LESS(bp, hi))) {
+		printf("Block %p is out of order in free tree\n", bp);
+		was_error = true;
+	}
+	for (i = 0; i < 2; i++) {
+		child = (void*) GET(i == 0 ? TREE_LEFT(bp) : TREE_RIGHT(bp));
+		if (child != NULL && TREE_PRIO(child) > TREE_PRIO(bp)) {
+			printf("Block %p outranks its parent %p in free tree\n",
+			       child, bp);
+			was_error = true;
+		}
+	}
+	was_error |= checktree((void*) GET(TREE_LEFT(bp)), lo, bp, verbose,
+	    count);
+	was_error |= checktree((void*) GET(TREE_RIGHT(bp)), bp, hi, verbose,
+	    count);
+	return (was_error);
 }
 
 /*
@@ -722,13 +2897,18 @@ printblock(void *bp)
 	//checkheap(false);
 	hsize = GET_SIZE(HDRP(bp));
 	halloc = GET_ALLOC(HDRP(bp));  
-	fsize = GET_SIZE(FTRP(bp));
-	falloc = GET_ALLOC(FTRP(bp));  
 
 	if (hsize == 0) {
 		printf("%p: end of heap\n", bp);
 		return;
 	}
+	if (halloc) {
+		printf("%p: header: [%zu:a%s]\n", bp, hsize,
+		       GET_PREVFREE(HDRP(bp)) ? " prev free" : "");
+		return;
+	}
+	fsize = GET_SIZE(FTRP(bp));
+	falloc = GET_ALLOC(FTRP(bp));  
 
 	printf("%p: header: [%zu:%c] footer: [%zu:%c] prev: (%p) next: (%p)\n", bp, 
 	       hsize, (halloc ? 'a' : 'f'), 
@@ -6,6 +6,62 @@ int	 mm_init(void);
 void	*mm_malloc(size_t size);
 void	 mm_free(void *ptr);
 void	*mm_realloc(void *ptr, size_t size);
+int	 mm_trim(size_t pad);
+void	*mm_memalign(size_t alignment, size_t size);
+size_t	 mm_usable_size(void *ptr);
+size_t	 mm_malloc_batch(size_t size, size_t n, void **out);
+void	 mm_free_batch(void **ptrs, size_t n);
+int	 mm_config(int param, size_t value);
+
+/*
+ * Regions hand out objects by bumping a pointer and free them all at once
+ * when the region is destroyed.
+ */
+struct mm_region;
+
+struct mm_region *mm_region_create(void);
+void	*mm_region_alloc(struct mm_region *rg, size_t size);
+void	 mm_region_destroy(struct mm_region *rg);
+
+/*
+ * Tunable parameters for mm_config.  mm_init also reads each one from the
+ * environment variable of the same name.
+ */
+#define	MM_CHUNK_SIZE		0	/* Smallest heap extension (bytes) */
+#define	MM_GROW_MAX		1	/* Largest adaptive heap extension */
+#define	MM_SPLIT_MIN		2	/* Smallest remainder split off a block */
+#define	MM_REALLOC_GROWTH	3	/* Percent a moved realloc block grows */
+#define	MM_TRIM_THRESHOLD	4	/* Free top block that triggers a trim
+					   (0, the default, never trims) */
+#define	MM_TRIM_PAD		5	/* Free bytes a trim keeps at the top */
+#define	MM_MMAP_THRESHOLD	6	/* Smallest request given a mapping */
+#define	MM_NPARAMS		7
+
+/* Number of segregated free list classes. */
+#define	MM_NCLASSES	34
+
+/*
+ * Allocator statistics, filled in by mm_stats.  Byte counts of live blocks
+ * are payload bytes; those of free blocks include their headers.
+ */
+struct mm_stats {
+	size_t	heap_bytes;		/* Heap held by all arenas */
+	size_t	mapped_bytes;		/* Mappings of huge blocks */
+	size_t	live_bytes;		/* Allocated payload in the heap */
+	size_t	live_blocks;		/* Allocated blocks in the heap */
+	size_t	free_bytes;		/* Free blocks in the heap */
+	size_t	free_blocks;
+	size_t	class_bytes[MM_NCLASSES];	/* Free bytes per class */
+	size_t	class_blocks[MM_NCLASSES];	/* Free blocks per class */
+	double	fragmentation;		/* 1 - largest free block / free bytes */
+	size_t	extends;		/* Heap extensions */
+	size_t	splits;			/* Free blocks split for a request */
+	size_t	coalesces;		/* Free blocks merged with a neighbor */
+	size_t	reallocs;		/* mm_realloc calls on a block... */
+	size_t	realloc_in_place;	/* ...that did not copy it */
+};
+
+void	 mm_stats(struct mm_stats *st);
 
 /*
  * Students work in teams of one or two.  Teams enter their team name, personal
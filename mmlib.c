@@ -0,0 +1,150 @@
+/*
+ * mmlib.c - Stand in for the C library's malloc with mm.c
+ *
+ * Usage: LD_PRELOAD=./libmm.so <program>
+ *
+ * libmm.so is the thread-safe build of mm.c, with 16-byte payloads, over
+ * a memlib heap reserved large enough for a real program.  This file
+ * gives it the C library's allocation interface: malloc, free, realloc,
+ * calloc, posix_memalign, aligned_alloc, memalign, valloc, pvalloc and
+ * malloc_usable_size.  The heap is set up by the first call, whichever
+ * thread makes it, and mm.c keeps the heap consistent across fork.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memlib.h"
+#include "mm.h"
+
+static pthread_once_t mmlib_once = PTHREAD_ONCE_INIT;
+static int mmlib_ready;  /* the heap is set up */
+
+/* mmlib_init - Set up the simulated heap and the allocator on it */
+static void mmlib_init(void)
+{
+    mem_init();
+    if (mm_init() < 0)
+	abort();
+    mmlib_ready = 1;
+}
+
+/* mmlib_start - Set up the heap if no call has done so yet */
+static inline void mmlib_start(void)
+{
+    if (!__atomic_load_n(&mmlib_ready, __ATOMIC_ACQUIRE))
+	pthread_once(&mmlib_once, mmlib_init);
+}
+
+/*
+ * MIN_SIZE - Size given to requests of zero bytes, which the C library
+ *     answers with a unique pointer rather than NULL
+ */
+#define MIN_SIZE(size) ((size) == 0 ? 1 : (size))
+
+void *malloc(size_t size)
+{
+    void *p;
+
+    mmlib_start();
+    if ((p = mm_malloc(MIN_SIZE(size))) == NULL)
+	errno = ENOMEM;
+    return p;
+}
+
+void free(void *ptr)
+{
+    if (ptr == NULL)
+	return;
+    mmlib_start();
+    mm_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    size_t bytes;
+    void *p;
+
+    if (__builtin_mul_overflow(nmemb, size, &bytes)) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    /*
+     * mm_malloc, not malloc: the compiler would turn malloc and memset
+     * back into a call to calloc.
+     */
+    mmlib_start();
+    if ((p = mm_malloc(MIN_SIZE(bytes))) != NULL)
+	memset(p, 0, bytes);
+    else
+	errno = ENOMEM;
+    return p;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    void *p;
+
+    if (ptr == NULL)
+	return malloc(size);
+    mmlib_start();
+    if ((p = mm_realloc(ptr, size)) == NULL && size != 0)
+	errno = ENOMEM;
+    return p;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *p;
+
+    if (alignment % sizeof(void *) != 0 ||
+	(alignment & (alignment - 1)) != 0 || alignment == 0)
+	return EINVAL;
+    mmlib_start();
+    if ((p = mm_memalign(alignment, MIN_SIZE(size))) == NULL)
+	return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    void *p;
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+	errno = EINVAL;
+	return NULL;
+    }
+    mmlib_start();
+    if ((p = mm_memalign(alignment, MIN_SIZE(size))) == NULL)
+	errno = ENOMEM;
+    return p;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+    return memalign(mem_pagesize(), size);
+}
+
+void *pvalloc(size_t size)
+{
+    size_t page = mem_pagesize();
+
+    return memalign(page, (MIN_SIZE(size) + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    if (ptr == NULL)
+	return 0;
+    return mm_usable_size(ptr);
+}
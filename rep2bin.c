@@ -0,0 +1,95 @@
+/*
+ * rep2bin.c - Convert a text trace (.rep) to the binary trace format
+ *
+ * Usage: rep2bin <in.rep> <out.bin>
+ *
+ * Every request of the text trace is checked while it is converted, and
+ * mdriver checks the binary records again when it loads them.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "tracefmt.h"
+
+#define MAXLINE 1024 /* max string size */
+
+/*
+ * fail - Report an error in the input trace and exit
+ */
+static void fail(char *path, unsigned opnum, char *msg)
+{
+    fprintf(stderr, "rep2bin: %s, request %u: %s\n", path, opnum, msg);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    tracehdr_t hdr;
+    traceop_t op;
+    char type[MAXLINE];
+    unsigned index, size;
+    unsigned opnum;
+
+    if (argc != 3) {
+	fprintf(stderr, "Usage: rep2bin <in.rep> <out.bin>\n");
+	exit(1);
+    }
+    if ((in = fopen(argv[1], "r")) == NULL) {
+	fprintf(stderr, "rep2bin: %s: %s\n", argv[1], strerror(errno));
+	exit(1);
+    }
+    if ((out = fopen(argv[2], "w")) == NULL) {
+	fprintf(stderr, "rep2bin: %s: %s\n", argv[2], strerror(errno));
+	exit(1);
+    }
+
+    /* The header carries over the four fields of the text header */
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    if (fscanf(in, "%u %u %u %u", &hdr.sugg_heapsize, &hdr.num_ids, 
+	       &hdr.num_ops, &hdr.weight) != 4)
+	fail(argv[1], 0, "bad header");
+    hdr.op_size = sizeof(traceop_t);
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    /* Convert every request line, checking it as mdriver would */
+    memset(&op, 0, sizeof(op));
+    for (opnum = 0; fscanf(in, "%s", type) != EOF; opnum++) {
+	if (opnum == hdr.num_ops)
+	    fail(argv[1], opnum, "more requests than the header says");
+	switch (type[0]) {
+	case 'a':
+	case 'r':
+	    if (fscanf(in, "%u %u", &index, &size) != 2)
+		fail(argv[1], opnum, "bad request");
+	    op.type = (type[0] == 'a') ? ALLOC : REALLOC;
+	    op.size = size;
+	    break;
+	case 'f':
+	    if (fscanf(in, "%u", &index) != 1)
+		fail(argv[1], opnum, "bad request");
+	    op.type = FREE;
+	    op.size = 0;
+	    break;
+	default:
+	    fail(argv[1], opnum, "bogus request type");
+	}
+	if (index >= hdr.num_ids)
+	    fail(argv[1], opnum, "block index out of range");
+	op.index = index;
+	fwrite(&op, sizeof(op), 1, out);
+    }
+    if (opnum != hdr.num_ops)
+	fail(argv[1], opnum, "fewer requests than the header says");
+
+    fclose(in);
+    if (fclose(out) != 0) {
+	fprintf(stderr, "rep2bin: %s: %s\n", argv[2], strerror(errno));
+	exit(1);
+    }
+    exit(0);
+}
@@ -0,0 +1,229 @@
+/*
+ * stream.c - Streaming trace readers
+ *
+ * A stream decodes a trace of any length in chunks of STREAM_CHUNK
+ * requests, so that only two chunks are ever in memory. A prefetch thread
+ * decodes the next chunk into one buffer while the driver replays the
+ * other. Neither the request count in the trace's header nor its id count
+ * is trusted, so a trace that is still being captured can be replayed up
+ * to wherever it currently ends. A binary trace that ends partway through
+ * a request is reported as truncated.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "stream.h"
+
+#define MAXLINE 1024 /* max string size */
+
+struct stream {
+    FILE *file;
+    int binary;              /* does file hold a binary trace? */
+    unsigned num_ids;        /* the header's id count */
+    traceop_t *bufs[2];      /* chunks being replayed and decoded */
+    unsigned counts[2];      /* requests in each full chunk */
+    int full[2];             /* is the chunk decoded and not yet replayed? */
+    int next;                /* the chunk stream_next returns next */
+    int held;                /* the chunk being replayed, or -1 */
+    int stop;                /* set to make the prefetch thread exit */
+    pthread_t thread;
+    pthread_mutex_t lock;    /* protects counts, full and stop */
+    pthread_cond_t cond;     /* signals changes to full and stop */
+};
+
+/*
+ * stream_error - Report a malformed trace and exit
+ */
+static void stream_error(char *msg)
+{
+    printf("%s\n", msg);
+    exit(1);
+}
+
+/*
+ * decode - Decode up to STREAM_CHUNK requests into ops and return how
+ *     many there were. Returns 0 at the end of the trace.
+ */
+static unsigned decode(stream_t *s, traceop_t *ops)
+{
+    char type[MAXLINE];
+    unsigned i, n, index, size;
+    size_t len;
+
+    if (s->binary) {
+	/* A short read ends the trace, and must end it on a record */
+	len = fread(ops, 1, STREAM_CHUNK * sizeof(traceop_t), s->file);
+	if (len % sizeof(traceop_t) != 0)
+	    stream_error("Truncated request in trace stream");
+	n = len / sizeof(traceop_t);
+	for (i = 0; i < n; i++)
+	    if (!trace_op_ok(&ops[i], TRACE_MAX_IDS))
+		stream_error("Bad request in trace stream");
+	return n;
+    }
+
+    for (n = 0; n < STREAM_CHUNK && fscanf(s->file, "%s", type) == 1; n++) {
+	switch (type[0]) {
+	case 'a':
+	case 'r':
+	    if (fscanf(s->file, "%u %u", &index, &size) != 2)
+		stream_error("Truncated request in trace stream");
+	    ops[n].type = (type[0] == 'a') ? ALLOC : REALLOC;
+	    ops[n].size = size;
+	    break;
+	case 'f':
+	    if (fscanf(s->file, "%u", &index) != 1)
+		stream_error("Truncated request in trace stream");
+	    ops[n].type = FREE;
+	    ops[n].size = 0;
+	    break;
+	default:
+	    stream_error("Bogus type character in trace stream");
+	}
+	if (index >= TRACE_MAX_IDS || ops[n].size < 0)
+	    stream_error("Bad request in trace stream");
+	ops[n].index = index;
+    }
+    return n;
+}
+
+/*
+ * prefetch - The body of the prefetch thread. It fills the two chunks in
+ *     turn, waiting for each to be replayed before decoding into it
+ *     again, and marks the end of the trace with an empty chunk.
+ */
+static void *prefetch(void *arg)
+{
+    stream_t *s = arg;
+    unsigned n;
+    int i = 0;
+
+    do {
+	pthread_mutex_lock(&s->lock);
+	while (s->full[i] && !s->stop)
+	    pthread_cond_wait(&s->cond, &s->lock);
+	if (s->stop) {
+	    pthread_mutex_unlock(&s->lock);
+	    break;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	n = decode(s, s->bufs[i]);
+
+	pthread_mutex_lock(&s->lock);
+	s->counts[i] = n;
+	s->full[i] = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	i = !i;
+    } while (n > 0);
+    return NULL;
+}
+
+/*
+ * stream_open - Open a text or binary trace at path and start the
+ *     prefetch thread
+ */
+stream_t *stream_open(char *path)
+{
+    stream_t *s;
+    tracehdr_t hdr;
+    unsigned sugg_heapsize, num_ops, weight;
+    int c, rc;
+
+    if ((s = calloc(1, sizeof(stream_t))) == NULL ||
+	(s->bufs[0] = malloc(STREAM_CHUNK * sizeof(traceop_t))) == NULL ||
+	(s->bufs[1] = malloc(STREAM_CHUNK * sizeof(traceop_t))) == NULL)
+	stream_error("malloc failed in stream_open");
+    if ((s->file = fopen(path, "r")) == NULL) {
+	printf("Could not open %s in stream_open: %s\n", path, 
+	       strerror(errno));
+	exit(1);
+    }
+
+    /* A binary trace starts with TRACE_MAGIC, a text one with a digit */
+    if ((c = getc(s->file)) == TRACE_MAGIC[0]) {
+	hdr.magic[0] = c;
+	if (fread(hdr.magic + 1, sizeof(hdr) - 1, 1, s->file) != 1 ||
+	    memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0)
+	    stream_error("Bad binary trace header in stream_open");
+	if (hdr.op_size != sizeof(traceop_t))
+	    stream_error("Binary trace has a different byte order or "
+			 "record layout");
+	s->binary = 1;
+	s->num_ids = hdr.num_ids;
+    } else {
+	ungetc(c, s->file);
+	if (fscanf(s->file, "%u %u %u %u", &sugg_heapsize, &s->num_ids, 
+		   &num_ops, &weight) != 4)
+	    stream_error("Bad text trace header in stream_open");
+    }
+
+    s->held = -1;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    if ((rc = pthread_create(&s->thread, NULL, prefetch, s)) != 0) {
+	printf("pthread_create failed in stream_open: %s\n", strerror(rc));
+	exit(1);
+    }
+    return s;
+}
+
+/*
+ * stream_num_ids - The number of block ids the trace's header claims
+ */
+unsigned stream_num_ids(stream_t *s)
+{
+    return s->num_ids;
+}
+
+/*
+ * stream_next - Hand the chunk returned last time back to the prefetch
+ *     thread, then wait for the next one. Returns NULL at the end of
+ *     the trace.
+ */
+traceop_t *stream_next(stream_t *s, unsigned *n)
+{
+    int i = s->next;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->held >= 0) {
+	s->full[s->held] = 0;
+	s->held = -1;
+	pthread_cond_broadcast(&s->cond);
+    }
+    while (!s->full[i])
+	pthread_cond_wait(&s->cond, &s->lock);
+    *n = s->counts[i];
+    pthread_mutex_unlock(&s->lock);
+
+    /* The empty chunk that marks the end stays full for good */
+    if (*n == 0)
+	return NULL;
+    s->held = i;
+    s->next = !i;
+    return s->bufs[i];
+}
+
+/*
+ * stream_close - Stop the prefetch thread and free the stream
+ */
+void stream_close(stream_t *s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+
+    fclose(s->file);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    free(s->bufs[0]);
+    free(s->bufs[1]);
+    free(s);
+}
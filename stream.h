@@ -0,0 +1,21 @@
+/*
+ * Streaming trace readers 
+ */
+#include "tracefmt.h"
+
+#define STREAM_CHUNK 65536 /* requests decoded at a time */
+
+typedef struct stream stream_t;
+
+/* Open a text or binary trace at path and start decoding it ahead */
+stream_t *stream_open(char *path);
+
+/* The number of block ids the trace's header claims (only a hint) */
+unsigned stream_num_ids(stream_t *s);
+
+/* Return the next chunk of *n requests, or NULL at the end of the trace.
+   The chunk stays valid until the next call. */
+traceop_t *stream_next(stream_t *s, unsigned *n);
+
+/* Stop decoding and close the trace */
+void stream_close(stream_t *s);
@@ -0,0 +1,582 @@
+/*
+ * tracecap.c - Capture a program's allocation trace for mdriver
+ *
+ * Usage: LD_PRELOAD=./libtracecap.so TRACECAP_OUT=app.rep <program>
+ *
+ * The shim interposes on malloc, free, realloc and calloc and gives every
+ * live block an id, reusing the ids of freed blocks so that the trace
+ * needs no more ids than the program ever had live blocks.  Each thread
+ * appends its requests to a private buffer, stamped with a global sequence
+ * number, and writes the buffer to a raw log when it fills.  When the
+ * program exits, the log is sorted back into sequence order and written
+ * to TRACECAP_OUT (tracecap.<pid>.rep by default) as a text trace, or as
+ * a binary trace if the name ends in ".bin".
+ *
+ * Zero-byte requests and requests of more than INT_MAX bytes are not
+ * traced, and neither are frees of blocks that were not traced.  A forked
+ * child is not traced.  Requests made by threads that are still running
+ * while the program exits may be lost.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tracefmt.h"
+
+#define MAXLINE     1024 /* max string size */
+#define BUF_RECORDS 4096 /* requests a thread buffers before logging them */
+#define NSTRIPES    64   /* locks that split up the id table */
+#define STRIPE_MIN  1024 /* initial slots in each stripe of the id table */
+#define BOOT_SIZE   4096 /* memory for dlsym's allocations during startup */
+
+/* A request and its place in the global order */
+typedef struct {
+    uint64_t seq;
+    traceop_t op;
+} record_t;
+
+/* A thread's buffer of requests that have not been logged yet */
+typedef struct tbuf {
+    record_t recs[BUF_RECORDS];
+    int n;                 /* records in recs */
+    int inuse;             /* does a live thread own this buffer? */
+    struct tbuf *next;     /* next in the list of all buffers */
+} tbuf_t;
+
+/* Maps the address of each traced block to its id */
+typedef struct {
+    void *ptr;             /* NULL for an empty slot */
+    unsigned id;
+} entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    entry_t *slots;        /* open addressing with linear probing */
+    size_t cap;            /* a power of two */
+    size_t count;
+} stripe_t;
+
+/* The allocator being traced */
+static void *(*real_malloc)(size_t);
+static void (*real_free)(void *);
+static void *(*real_realloc)(void *, size_t);
+static void *(*real_calloc)(size_t, size_t);
+
+static int capturing;              /* is the trace being recorded? */
+static pid_t owner;                /* the process being traced */
+static int resolving;              /* is dlsym running? */
+static char boot[BOOT_SIZE];       /* serves allocations during dlsym */
+static size_t boot_used;
+
+static char out_path[MAXLINE];     /* the trace to write at exit */
+static char log_path[MAXLINE];     /* the raw log of unsorted records */
+static int log_fd = -1;
+static uint64_t next_seq;          /* the next request's sequence number */
+
+static stripe_t stripes[NSTRIPES];
+
+static pthread_mutex_t id_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned num_ids;           /* ids handed out so far */
+static unsigned *free_ids;         /* ids of freed blocks, for reuse */
+static size_t num_free, free_cap;
+
+static pthread_mutex_t buf_lock = PTHREAD_MUTEX_INITIALIZER;
+static tbuf_t *bufs;               /* every thread buffer */
+static pthread_key_t buf_key;      /* releases a buffer at thread exit */
+static __thread tbuf_t *tbuf;      /* this thread's buffer */
+static __thread int tbuf_released; /* has this thread given it back? */
+
+/*
+ * grow_map - Return a mapping of new_len bytes holding the first len bytes
+ *     of the mapping old, which is unmapped. The shim's own tables live in
+ *     mappings so that they never call the allocator being traced.
+ */
+static void *grow_map(void *old, size_t len, size_t new_len)
+{
+    void *p = mmap(NULL, new_len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (p == MAP_FAILED)
+	abort();
+    if (old != NULL) {
+	memcpy(p, old, len);
+	munmap(old, len);
+    }
+    return p;
+}
+
+/*
+ * hash - Hash a block address; the top bits pick the stripe
+ */
+static uint64_t hash(void *ptr)
+{
+    return ((uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15ULL;
+}
+
+/*
+ * stripe_insert - Map ptr to id in stripe s, whose lock is held
+ */
+static void stripe_insert(stripe_t *s, void *ptr, unsigned id)
+{
+    entry_t *old = s->slots;
+    size_t i, old_cap = s->cap;
+
+    /* Keep the table at most half full */
+    if (2 * (s->count + 1) > s->cap) {
+	s->cap = (s->cap > 0) ? 2 * s->cap : STRIPE_MIN;
+	s->slots = grow_map(NULL, 0, s->cap * sizeof(entry_t));
+	s->count = 0;
+	for (i = 0; i < old_cap; i++)
+	    if (old[i].ptr != NULL)
+		stripe_insert(s, old[i].ptr, old[i].id);
+	if (old != NULL)
+	    munmap(old, old_cap * sizeof(entry_t));
+    }
+    for (i = hash(ptr) & (s->cap - 1); s->slots[i].ptr != NULL;
+	 i = (i + 1) & (s->cap - 1))
+	;
+    s->slots[i].ptr = ptr;
+    s->slots[i].id = id;
+    s->count++;
+}
+
+/*
+ * stripe_remove - Unmap ptr in stripe s, whose lock is held, and return
+ *     its id, or -1 if ptr is not traced
+ */
+static long stripe_remove(stripe_t *s, void *ptr)
+{
+    size_t i, j, k;
+    unsigned id;
+
+    if (s->cap == 0)
+	return -1;
+    for (i = hash(ptr) & (s->cap - 1); s->slots[i].ptr != ptr;
+	 i = (i + 1) & (s->cap - 1))
+	if (s->slots[i].ptr == NULL)
+	    return -1;
+    id = s->slots[i].id;
+    s->count--;
+
+    /* Shift later entries of the probe sequence back into the hole */
+    for (j = (i + 1) & (s->cap - 1); s->slots[j].ptr != NULL;
+	 j = (j + 1) & (s->cap - 1)) {
+	k = hash(s->slots[j].ptr) & (s->cap - 1);
+	if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+	    s->slots[i] = s->slots[j];
+	    i = j;
+	}
+    }
+    s->slots[i].ptr = NULL;
+    return id;
+}
+
+/*
+ * stripe_of - Return the stripe of the id table that holds ptr
+ */
+static stripe_t *stripe_of(void *ptr)
+{
+    return &stripes[hash(ptr) >> 58];
+}
+
+/*
+ * id_get - Return an unused id, reusing that of a freed block if any
+ */
+static unsigned id_get(void)
+{
+    unsigned id;
+
+    pthread_mutex_lock(&id_lock);
+    id = (num_free > 0) ? free_ids[--num_free] : num_ids++;
+    pthread_mutex_unlock(&id_lock);
+    return id;
+}
+
+/*
+ * id_put - Make the id of a freed block available again
+ */
+static void id_put(unsigned id)
+{
+    pthread_mutex_lock(&id_lock);
+    if (num_free == free_cap) {
+	free_ids = grow_map(free_ids, free_cap * sizeof(unsigned),
+			    (free_cap ? 2 * free_cap : 4096) * sizeof(unsigned));
+	free_cap = free_cap ? 2 * free_cap : 4096;
+    }
+    free_ids[num_free++] = id;
+    pthread_mutex_unlock(&id_lock);
+}
+
+/*
+ * log_write - Append n records at recs to the raw log
+ */
+static void log_write(const record_t *recs, size_t n)
+{
+    size_t len = n * sizeof(record_t);
+    const char *p = (const char *)recs;
+    ssize_t rc;
+
+    pthread_mutex_lock(&buf_lock);
+    for (; len > 0; p += rc, len -= rc)
+	if ((rc = write(log_fd, p, len)) <= 0)
+	    break;
+    pthread_mutex_unlock(&buf_lock);
+}
+
+/*
+ * buf_flush - Append the records in buffer b to the raw log
+ */
+static void buf_flush(tbuf_t *b)
+{
+    log_write(b->recs, b->n);
+    b->n = 0;
+}
+
+/*
+ * buf_release - Log what is left in an exiting thread's buffer and let
+ *     another thread have the buffer.  Requests the thread makes after
+ *     this, from later destructors, are logged one at a time.
+ */
+static void buf_release(void *arg)
+{
+    tbuf_t *b = arg;
+
+    if (capturing && b->n > 0)
+	buf_flush(b);
+    tbuf = NULL;
+    tbuf_released = 1;
+    pthread_mutex_lock(&buf_lock);
+    b->inuse = 0;
+    pthread_mutex_unlock(&buf_lock);
+}
+
+/*
+ * record - Add a request with sequence number seq to this thread's buffer
+ */
+static void record(uint64_t seq, int type, unsigned id, size_t size)
+{
+    record_t *r, one;
+    tbuf_t *b;
+
+    if (tbuf_released) {
+	/* The buffer may already belong to another thread */
+	one.seq = seq;
+	one.op.type = type;
+	one.op.index = id;
+	one.op.size = size;
+	log_write(&one, 1);
+	return;
+    }
+    if (tbuf == NULL) {
+	/* Take over the buffer of a thread that has exited, if any */
+	pthread_mutex_lock(&buf_lock);
+	for (b = bufs; b != NULL && b->inuse; b = b->next)
+	    ;
+	if (b == NULL) {
+	    b = grow_map(NULL, 0, sizeof(tbuf_t));
+	    b->next = bufs;
+	    bufs = b;
+	}
+	b->inuse = 1;
+	pthread_mutex_unlock(&buf_lock);
+	tbuf = b;
+	pthread_setspecific(buf_key, b);
+    }
+    if (tbuf->n == BUF_RECORDS)
+	buf_flush(tbuf);
+    r = &tbuf->recs[tbuf->n++];
+    r->seq = seq;
+    r->op.type = type;
+    r->op.index = id;
+    r->op.size = size;
+}
+
+/*
+ * trace_alloc - Trace the allocation of a block of size bytes at ptr
+ */
+static void trace_alloc(void *ptr, size_t size)
+{
+    stripe_t *s = stripe_of(ptr);
+    unsigned id = id_get();
+    uint64_t seq;
+
+    pthread_mutex_lock(&s->lock);
+    stripe_insert(s, ptr, id);
+    seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&s->lock);
+    record(seq, ALLOC, id, size);
+}
+
+/*
+ * trace_free - Trace the free of the block at ptr, before the block is
+ *     freed, so that no other thread can have been given its address yet
+ */
+static void trace_free(void *ptr)
+{
+    stripe_t *s = stripe_of(ptr);
+    uint64_t seq;
+    long id;
+
+    pthread_mutex_lock(&s->lock);
+    id = stripe_remove(s, ptr);
+    seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&s->lock);
+    if (id < 0)
+	return;
+    record(seq, FREE, id, 0);
+    id_put(id);
+}
+
+/*
+ * resolve - Find the allocator being traced
+ */
+static void resolve(void)
+{
+    resolving = 1;
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    resolving = 0;
+    if (!real_malloc || !real_free || !real_realloc || !real_calloc)
+	abort();
+}
+
+/*
+ * boot_alloc - Serve an allocation made by dlsym while resolve runs
+ */
+static void *boot_alloc(size_t size)
+{
+    void *p;
+
+    size = (size + 15) & ~(size_t)15;
+    if (boot_used + size > BOOT_SIZE)
+	return NULL;
+    p = boot + boot_used;
+    boot_used += size;
+    return p;
+}
+
+#define IN_BOOT(p) ((char *)(p) >= boot && (char *)(p) < boot + BOOT_SIZE)
+
+/*
+ * traced - Is a request of size bytes worth tracing?
+ */
+static int traced(size_t size)
+{
+    return capturing && size > 0 && size <= INT_MAX;
+}
+
+void *malloc(size_t size)
+{
+    void *p;
+
+    if (real_malloc == NULL) {
+	if (resolving)
+	    return boot_alloc(size);
+	resolve();
+    }
+    if ((p = real_malloc(size)) != NULL && traced(size))
+	trace_alloc(p, size);
+    return p;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *p;
+
+    if (real_calloc == NULL) {
+	if (resolving)
+	    return boot_alloc(nmemb * size);  /* boot is zeroed */
+	resolve();
+    }
+    if ((p = real_calloc(nmemb, size)) != NULL &&
+	(size == 0 || nmemb <= INT_MAX / size) && traced(nmemb * size))
+	trace_alloc(p, nmemb * size);
+    return p;
+}
+
+void free(void *ptr)
+{
+    if (ptr == NULL || IN_BOOT(ptr))
+	return;
+    if (real_free == NULL)
+	resolve();
+    if (capturing)
+	trace_free(ptr);
+    real_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    stripe_t *s;
+    uint64_t seq;
+    long id;
+    void *p;
+
+    if (IN_BOOT(ptr)) {
+	/* Move a block dlsym allocated to the real heap */
+	if ((p = malloc(size)) != NULL)
+	    memcpy(p, ptr, (size < (size_t)(boot + BOOT_SIZE - (char *)ptr)) ?
+		   size : (size_t)(boot + BOOT_SIZE - (char *)ptr));
+	return p;
+    }
+    if (real_realloc == NULL)
+	resolve();
+    if (ptr == NULL)
+	return malloc(size);
+    if (!capturing)
+	return real_realloc(ptr, size);
+    if (size == 0 || size > INT_MAX) {
+	/* Trace it as a free; a block too big to trace is untraced */
+	trace_free(ptr);
+	return real_realloc(ptr, size);
+    }
+
+    /* Untrace the old block before its address can be handed out again */
+    s = stripe_of(ptr);
+    pthread_mutex_lock(&s->lock);
+    id = stripe_remove(s, ptr);
+    pthread_mutex_unlock(&s->lock);
+
+    if ((p = real_realloc(ptr, size)) == NULL) {
+	if (id >= 0) {
+	    pthread_mutex_lock(&s->lock);
+	    stripe_insert(s, ptr, id);
+	    pthread_mutex_unlock(&s->lock);
+	}
+	return NULL;
+    }
+    if (id < 0) {
+	trace_alloc(p, size);
+	return p;
+    }
+    s = stripe_of(p);
+    pthread_mutex_lock(&s->lock);
+    stripe_insert(s, p, id);
+    seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&s->lock);
+    record(seq, REALLOC, id, size);
+    return p;
+}
+
+/*
+ * stop_child - Don't trace a forked child; the parent owns the log
+ */
+static void stop_child(void)
+{
+    capturing = 0;
+}
+
+/*
+ * tracecap_init - Open the raw log and start tracing
+ */
+__attribute__((constructor))
+static void tracecap_init(void)
+{
+    char *out = getenv("TRACECAP_OUT");
+    int i;
+
+    if (real_malloc == NULL)
+	resolve();
+    if (out != NULL && strlen(out) < MAXLINE - 8)
+	strcpy(out_path, out);
+    else
+	snprintf(out_path, MAXLINE, "tracecap.%d.rep", (int)getpid());
+    snprintf(log_path, MAXLINE, "%s.raw", out_path);
+    if ((log_fd = open(log_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+	perror(log_path);
+	return;
+    }
+    for (i = 0; i < NSTRIPES; i++)
+	pthread_mutex_init(&stripes[i].lock, NULL);
+    pthread_key_create(&buf_key, buf_release);
+    pthread_atfork(NULL, NULL, stop_child);
+    owner = getpid();
+    capturing = 1;
+}
+
+/*
+ * cmp_seq - Order records by sequence number for qsort
+ */
+static int cmp_seq(const void *a, const void *b)
+{
+    uint64_t x = ((const record_t *)a)->seq;
+    uint64_t y = ((const record_t *)b)->seq;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * tracecap_fini - Stop tracing, sort the raw log and write the trace
+ */
+__attribute__((destructor))
+static void tracecap_fini(void)
+{
+    record_t *recs;
+    tracehdr_t hdr;
+    struct stat st;
+    size_t i, n, len;
+    FILE *out;
+    tbuf_t *b;
+    int binary;
+
+    if (!capturing || getpid() != owner)
+	return;
+    capturing = 0;
+    for (b = bufs; b != NULL; b = b->next)
+	if (b->n > 0)
+	    buf_flush(b);
+
+    /* Sort the records, which each thread logged in its own order */
+    if (fstat(log_fd, &st) < 0 || st.st_size == 0)
+	goto done;
+    len = st.st_size;
+    n = len / sizeof(record_t);
+    recs = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, log_fd, 0);
+    if (recs == MAP_FAILED)
+	goto done;
+    qsort(recs, n, sizeof(record_t), cmp_seq);
+
+    len = strlen(out_path);
+    binary = (len >= 4 && strcmp(out_path + len - 4, ".bin") == 0);
+    if ((out = fopen(out_path, "w")) == NULL) {
+	perror(out_path);
+	goto done;
+    }
+    if (binary) {
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.num_ids = num_ids;
+	hdr.num_ops = n;
+	hdr.weight = 1;
+	hdr.op_size = sizeof(traceop_t);
+	fwrite(&hdr, sizeof(hdr), 1, out);
+	for (i = 0; i < n; i++)
+	    fwrite(&recs[i].op, sizeof(traceop_t), 1, out);
+    } else {
+	fprintf(out, "0\n%u\n%zu\n1\n", num_ids, n);
+	for (i = 0; i < n; i++) {
+	    if (recs[i].op.type == ALLOC)
+		fprintf(out, "a %d %d\n", recs[i].op.index, recs[i].op.size);
+	    else if (recs[i].op.type == REALLOC)
+		fprintf(out, "r %d %d\n", recs[i].op.index, recs[i].op.size);
+	    else
+		fprintf(out, "f %d\n", recs[i].op.index);
+	}
+    }
+    fclose(out);
+    munmap(recs, st.st_size);
+ done:
+    close(log_fd);
+    unlink(log_path);
+}
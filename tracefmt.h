@@ -0,0 +1,46 @@
+#ifndef __TRACEFMT_H_
+#define __TRACEFMT_H_
+
+/*
+ * tracefmt.h - The binary trace format read by mdriver and written by
+ *     rep2bin
+ *
+ * A binary trace is a tracehdr_t followed by num_ops traceop_t records,
+ * in the writer's byte order and struct layout, so that mdriver can map
+ * the file and replay the records in place without parsing them. The
+ * op_size field doubles as a check that the reader's layout and byte
+ * order match the writer's.
+ */
+#include <stdint.h>
+
+#define TRACE_MAGIC "MMTRACE1"  /* first 8 bytes of a binary trace */
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+    enum {ALLOC, FREE, REALLOC} type; /* type of request */
+    int index;                        /* index for free() to use later */
+    int size;                         /* byte size of alloc/realloc request */
+} traceop_t;
+
+/* The header of a binary trace; the same four fields as a .rep file */
+typedef struct {
+    char magic[8];            /* TRACE_MAGIC, without its '\0' */
+    uint32_t sugg_heapsize;   /* suggested heap size (unused) */
+    uint32_t num_ids;         /* number of alloc/realloc ids */
+    uint32_t num_ops;         /* number of traceop_t records that follow */
+    uint32_t weight;          /* weight for this trace (unused) */
+    uint32_t op_size;         /* sizeof(traceop_t) */
+    uint32_t pad;             /* keeps the records 8-byte aligned */
+} tracehdr_t;
+
+/* Largest number of ids a streamed trace may use */
+#define TRACE_MAX_IDS (1U << 28)
+
+/* Nonzero if op is a request of a known type on an id below num_ids */
+static inline int trace_op_ok(const traceop_t *op, unsigned num_ids)
+{
+    return (op->type == ALLOC || op->type == FREE || op->type == REALLOC) &&
+	op->index >= 0 && (unsigned)op->index < num_ids && op->size >= 0;
+}
+
+#endif /* __TRACEFMT_H_ */